@@ -1,30 +1,130 @@
 #ifndef __HIGH_CONCURRENT_MEMORY_POOL_CENTRAL_CACHE_H__
 #define __HIGH_CONCURRENT_MEMORY_POOL_CENTRAL_CACHE_H__
 #include "common.h"
+#include "numa.h"
+#include "stats.h"
+#include "transfer_cache.h"
 
+// central cache 中一个 size class 的 span，按占用程度分组
+// 还有空闲对象的 span 按已分配的比例 use_count_ / capacity 挂在 kLevels 个链表中，
+// 对象全部分配出去的 span 不在任何链表中，有对象还回来时再挂回去
+// 申请时从最满的一组取，几乎空闲的 span 不再分配新的对象，容易整体还给 page cache
+// 所有操作都需要持有 lock_，按 cache line 对齐，相邻 size class 的锁不会伪共享
+class alignas(kCacheLineSize) OccupancyLists {
+ public:
+  static const size_t kLevels = 8;
+
+  explicit OccupancyLists(size_t capacity = 1) : capacity_(capacity) {}
+
+  void set_capacity(size_t capacity) { capacity_ = capacity; }
+
+  // 最满的一个还有空闲对象的 span，没有时返回 nullptr
+  Span* fullest();
+
+  // 把还有空闲对象的 span 挂到 use_count_ 对应的链表
+  void insert(Span* span);
+
+  // 把 span 从所在的链表中摘下，was_full 表示 span 是满的，不在任何链表中
+  void remove(Span* span, bool was_full);
+
+  // span 的 use_count_ 从 old_use_count 变化以后调整所在的链表：
+  // 原来是满的就挂回去，现在满了就摘下，所在的组变了就换一个链表
+  void update(Span* span, size_t old_use_count, bool was_full);
+
+  // span 的对象是否全部分配出去了
+  bool full(const Span* span) const { return span->use_count_ == capacity_; }
+
+  // 没有任何 span
+  bool empty() const;
+
+  // 已满的 span 个数
+  size_t full_spans() const { return full_spans_; }
+
+  SpanList& list(size_t level) { return lists_[level]; }
+
+  BucketMutex lock_;
+
+ private:
+  size_t level(size_t use_count) const {
+    return use_count * kLevels / capacity_;
+  }
+
+  SpanList lists_[kLevels];
+  size_t capacity_;
+  size_t full_spans_ = 0;
+};
+
+// 每个 NUMA 节点一个实例，只管理从本节点 page cache 申请的 span
 class CentralCache {
  public:
-  // 单例模式
+  // 单例模式，返回当前线程所在节点的实例
   static CentralCache* GetInstance();
+  static CentralCache* GetInstance(size_t node);
+
+  // 实例所属的 NUMA 节点
+  size_t node() const { return Instances::index_of(this); }
 
   // 从中心缓存获取一定数量的对象给 thread cache
   size_t fetch_range_objs(void*& start, void*& end, size_t size, size_t n);
 
-  // 从span_list中获取一个span
-  Span* get_one_span(SpanList& span_list, size_t size);
+  // 从 spans 中获取最满的一个还有空闲对象的 span，没有时向 page cache 申请
+  // 调用时持有 spans.lock_，返回时仍然持有
+  Span* get_one_span(OccupancyLists& spans, size_t size);
+
+  // thread cache 归还 [start, end] 共 n 个大小为 size 的对象
+  // 先放进 transfer cache，放不下再归还给 span
+  void release_range_objs(void* start, void* end, size_t n, size_t size);
 
   // start 指向的链表归还给 central cache，链表中的对象大小为 size
   // thread cache 中自由链表归还的并不一定连续，可能在多个span中
+  // 属于其他节点的对象转交给对应节点的 central cache
   void release_list_to_spans(void* start, size_t size);
 
+  // 把 transfer cache 中缓存的对象全部归还给 span
+  void drain_transfer_caches();
+
+  // 把本实例的 span、空闲字节数、计数器和锁竞争累加到 stats 中
+  void collect_stats(HcStats& stats);
+
  private:
-  CentralCache() = default;
+  friend class LeakyInstances<CentralCache, MAX_NUMA_NODES>;
+  typedef LeakyInstances<CentralCache, MAX_NUMA_NODES> Instances;
+
+  CentralCache();
   CentralCache(const CentralCache&) = delete;
   CentralCache& operator=(const CentralCache&) = delete;
 
+  // 链表中的对象是否都属于本节点
+  bool all_local(void* start) const;
+
+  // index 号 transfer cache 最多缓存的对象数：MAX_TRANSFER_BATCHES 批当前批量
+  // 大小的对象，并且不超过 MAX_TRANSFER_BYTES 字节
+  static size_t transfer_capacity(size_t index, size_t size);
+
+  // release_list_to_spans 中属于同一个 span 的对象串成的链表
+  struct SpanGroup {
+    Span* span;
+    void* head;
+    void* tail;
+    size_t count;
+  };
+
+  // 归还时一次加锁最多处理的 span 个数，散列表的槽数是它的两倍
+  static const size_t kMaxReleaseGroups = 64;
+  static const size_t kReleaseSlots = 2 * kMaxReleaseGroups;
+  static_assert(kMaxReleaseGroups < 256, "散列表的槽用 uint8_t 存放组号");
+
+  // 加一次锁把每组对象整段放回各自的 span，空出来的 span 解锁后一次交给 page cache
+  void release_groups(OccupancyLists& spans, SpanGroup* groups, size_t n);
+
  private:
-  SpanList span_lists_[N_FREE_LIST];
-  static CentralCache central_cache_instance_;
+  OccupancyLists span_lists_[N_FREE_LIST];
+  TransferCache transfer_caches_[N_FREE_LIST];
+
+  SharedStatCounter span_fetches_;
+  SharedStatCounter span_releases_;
+  SharedStatCounter transfer_hits_;
+  SharedStatCounter transfer_misses_;
 };
 
 #endif  // __HIGH_CONCURRENT_MEMORY_POOL_CENTRAL_CACHE_H__
\ No newline at end of file
@@ -2,7 +2,9 @@
 #define __HIGH_CONCURRENT_MEMORY_POOL_COMMON_H__
 #include <atomic>
 #include <cassert>
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <mutex>
@@ -21,9 +23,6 @@
 // 小于等于 256KB 去 thread cache 申请，否则去 page cache 或者系统堆申请
 const size_t MAX_BYTES = 256 * 1024;
 
-// thread_cache 和 central cache 自由链表哈希桶的个数
-const size_t N_FREE_LIST = 208;
-
 // page cache 的桶的个数
 const size_t N_PAGES_BUCKET = 129;
 
@@ -31,22 +30,67 @@ const size_t N_PAGES_BUCKET = 129;
 const size_t SYSTEM_PAGE_SIZE = 4096;
 const size_t kPageShift = 12;
 
+// cache line 的大小，频繁加锁的桶按它对齐，避免相邻的桶伪共享
+const size_t kCacheLineSize = 64;
+
+// 透明大页（2MB）的大小和包含的页数
+const size_t kHugePageShift = 21;
+const size_t HUGE_PAGE_PAGES = 1 << (kHugePageShift - kPageShift);
+
 void *&get_next_obj(void *obj);
 
+// 自旋等待时提示 CPU 降低功耗、让出流水线给同一核心的其他超线程
+void cpu_relax();
+
+// *word 仍然等于 expected 时睡眠，直到被 futex_wake 唤醒（可能虚假唤醒）
+// 不支持 futex 的平台上只让出 CPU
+void futex_wait(std::atomic<uint32_t> *word, uint32_t expected);
+
+// 唤醒一个在 word 上睡眠的线程
+void futex_wake(std::atomic<uint32_t> *word);
+
 void *system_alloc(size_t page_count);
 
 void system_dealloc(void *ptr, size_t page_count);
 
+// 把 system_alloc 分配的 old_pages 页调整为 new_pages 页，内容保持不变，
+// 地址可能改变（Linux 上用 mremap，由内核移动页表而不复制数据）
+// 平台不支持或者失败时返回 nullptr，原来的内存保持不变
+void *system_realloc(void *ptr, size_t old_pages, size_t new_pages);
+
+// 按 2MB 对齐申请 page_count 个页，并建议内核使用透明大页
+// 平台不支持时返回 nullptr
+void *system_alloc_huge(size_t page_count);
+
+// 把物理页归还给操作系统，虚拟地址仍然保留，下次访问时重新分配
+// lazy 为 true 时使用 MADV_FREE，由内核在内存紧张时再回收
+// 返回之后读到的内容是否一定全为 0（MADV_FREE 的页在回收之前还保留原来的内容）
+bool system_release(void *ptr, size_t page_count, bool lazy);
+
+// 把 [ptr, ptr + size) 清零；大块内存用 non-temporal 写入，不把刚清零的
+// 数据挤进 cache，也省去写之前把 cache line 读进来的开销
+void zero_memory(void *ptr, size_t size);
+
 class FreeList {
  public:
   void push_front(void *obj);
   void *pop_front();
 
+  // 链表头部的对象，链表为空时返回 nullptr
+  void *peek() const { return free_list_; }
+
   bool empty() const;
 
   size_t &max_size();
   size_t size() const;
 
+  // 上次 reset_low_water() 以来链表长度的最小值，这部分对象一直没有被用到
+  size_t low_water() const { return low_water_; }
+  void reset_low_water() { low_water_ = size_; }
+
+  // 连续溢出（长度超过 max_size_ 而归还给 central cache）的次数
+  size_t &overages() { return overages_; }
+
   // 将一段包含 n 个对象的内存插入到自由链表中
   void push_range(void *start, void *end, size_t n);
 
@@ -58,47 +102,562 @@ class FreeList {
   size_t max_size_ = 1;  // 用于向 central cache 申请内存时的慢启动
   size_t size_ =
       0;  // 当前链表中的对象数量，用于判断是否需要向 central cache 归还内存
+  size_t low_water_ = 0;  // 长度的低水位
+  size_t overages_ = 0;   // 溢出次数，用于收缩 max_size_
 };
 
-// size的对齐映射规则
+// 默认的 size class 划分规则，只在编译期用来生成下面的查表
+// 针对不同大小的内存块采用不同的对齐策略，整体控制在最多10%左右的内碎⽚浪费
+// [1, 128]                      8byte对⻬          freelist[0, 16)
+// [128 + 1, 1024]               16byte对⻬         freelist[16, 72)
+// [1024 + 1, 8 * 1024]          128byte对⻬        freelist[72, 128)
+// [8 * 1024 + 1, 64 * 1024]     1024byte对⻬       freelist[128, 184)
+// [64 * 1024 + 1, 256 * 1024]   8 * 1024byte对⻬   freelist[184, 208)
+// 每个区间对齐以后的种类数是固定的，例如 [128 + 1, 1024] 区间中
+// 128/16=8, 1024/16=64，桶的数量是64-8=56，索引号从16开始，到16+56=72结束
+struct SizeClassRule {
+  // size 所在区间的对齐粒度（取对数）
+  static constexpr size_t align_shift(size_t size) {
+    return size <= 128         ? 3
+           : size <= 1024      ? 4
+           : size <= 8 * 1024  ? 7
+           : size <= 64 * 1024 ? 10
+                               : 13;
+  }
+
+  // size 所在区间的起点和区间之前的桶数
+  static constexpr size_t group_base(size_t size) {
+    return size <= 128         ? 0
+           : size <= 1024      ? 128
+           : size <= 8 * 1024  ? 1024
+           : size <= 64 * 1024 ? 8 * 1024
+                               : 64 * 1024;
+  }
+  static constexpr size_t group_first_index(size_t size) {
+    return size <= 128         ? 0
+           : size <= 1024      ? 16
+           : size <= 8 * 1024  ? 72
+           : size <= 64 * 1024 ? 128
+                               : 184;
+  }
+
+  static constexpr size_t index(size_t size) {
+    size_t shift = align_shift(size);
+    return ((size - group_base(size) + (size_t(1) << shift) - 1) >> shift) -
+           1 + group_first_index(size);
+  }
+
+  static constexpr size_t class_size(size_t size) {
+    size_t align = size_t(1) << align_shift(size);
+    return (size + align - 1) & ~(align - 1);
+  }
+
+  // [2, 512] 一次批量移动多少个对象的上限
+  // 小对象一次批量上限高，每次从中心缓存获取的对象数量多
+  // 大对象一次批量上限低，每次从中心缓存获取的对象数量少
+  static constexpr size_t num_objects(size_t size) {
+    size_t n = MAX_BYTES / size;
+    return n < 2 ? 2 : n > 512 ? 512 : n;
+  }
+
+  // 一次从 page cache 中获取多少页：至少放得下一批对象，
+  // 在 [1, 2] 倍之间选切分后尾部浪费比例最小的页数（相同时取较小的）
+  static constexpr size_t num_pages(size_t size) {
+    size_t min_pages =
+        (num_objects(size) * size + SYSTEM_PAGE_SIZE - 1) >> kPageShift;
+    size_t max_pages = (std::min)(min_pages * 2, N_PAGES_BUCKET - 1);
+    size_t best = min_pages;
+    for (size_t pages = min_pages + 1; pages <= max_pages; ++pages) {
+      // tail(pages) / pages < tail(best) / best
+      if (((pages << kPageShift) % size) * best <
+          ((best << kPageShift) % size) * pages) {
+        best = pages;
+      }
+    }
+    return best;
+  }
+};
+
+// 每个 size class 的元数据
+struct SizeClassInfo {
+  uint32_t size;         // 对齐后的对象大小
+  uint32_t num_objects;  // thread cache 一次从 central cache 获取的对象数（初始值）
+  uint32_t num_pages;    // central cache 一次从 page cache 获取的页数
+};
+
+#ifdef HC_SIZE_CLASS_TABLE
+// 使用 size_class_gen 根据实际的申请大小分布生成的表（kSizeClassDefs），
+// 编译时指定：cmake -DHC_SIZE_CLASS_TABLE=/path/to/table.h
+#include HC_SIZE_CLASS_TABLE
+const size_t N_FREE_LIST = sizeof(kSizeClassDefs) / sizeof(kSizeClassDefs[0]);
+#else
+// thread_cache 和 central cache 自由链表哈希桶的个数
+const size_t N_FREE_LIST = 208;
+#endif
+
+// 编译期生成的查表
+// class_index_ 按大小直接索引：[0, 1024] 每 8 字节一项，(1024, 256KB] 每 128 字节
+// 一项。size class 的大小在 1024 以内是 8 的倍数、以上是 128 的倍数，
+// 所以同一项里的大小属于同一个 size class
+struct SizeClassTables {
+  static constexpr size_t kMaxSmallSize = 1024;
+  static constexpr size_t kClassArraySize =
+      ((MAX_BYTES + 127 + (120 << 7)) >> 7) + 1;
+
+  static constexpr size_t class_array_index(size_t size) {
+    return size <= kMaxSmallSize ? (size + 7) >> 3
+                                 : (size + 127 + (120 << 7)) >> 7;
+  }
+
+  uint8_t class_index_[kClassArraySize] = {};
+  SizeClassInfo info_[N_FREE_LIST] = {};
+
+  constexpr SizeClassTables() {
+#ifdef HC_SIZE_CLASS_TABLE
+    for (size_t i = 0; i < N_FREE_LIST; ++i) {
+      info_[i] = kSizeClassDefs[i];
+    }
+#else
+    for (size_t size = 8; size <= MAX_BYTES; size += 8) {
+      if (SizeClassRule::class_size(size) == size) {
+        SizeClassInfo& info = info_[SizeClassRule::index(size)];
+        info.size = static_cast<uint32_t>(size);
+        info.num_objects =
+            static_cast<uint32_t>(SizeClassRule::num_objects(size));
+        info.num_pages = static_cast<uint32_t>(SizeClassRule::num_pages(size));
+      }
+    }
+#endif
+    // 每一项取这一项覆盖的最大的大小，映射到第一个不小于它的 size class
+    size_t index = 0;
+    for (size_t i = 0; i < kClassArraySize; ++i) {
+      size_t size = i <= (kMaxSmallSize >> 3) ? i << 3 : (i - 120) << 7;
+      while (index + 1 < N_FREE_LIST && info_[index].size < size) {
+        ++index;
+      }
+      class_index_[i] = static_cast<uint8_t>(index);
+    }
+  }
+
+  // 查表是否可用：大小严格递增并满足上面的粒度、最后一个是 MAX_BYTES、
+  // 桶边界两侧映射到相邻的桶、一个 span 至少放得下一个对象且不超过 128 页
+  constexpr bool verify() const {
+    size_t prev = 0;
+    for (size_t i = 0; i < N_FREE_LIST; ++i) {
+      const SizeClassInfo& info = info_[i];
+      size_t size = info.size;
+      size_t granularity = size <= kMaxSmallSize ? 8 : 128;
+      if (size <= prev || size % granularity != 0 ||
+          class_index_[class_array_index(size)] != i ||
+          class_index_[class_array_index(prev + 1)] != i ||
+          info.num_objects == 0 || info.num_pages == 0 ||
+          info.num_pages >= N_PAGES_BUCKET ||
+          (static_cast<size_t>(info.num_pages) << kPageShift) < size) {
+        return false;
+      }
+      prev = size;
+    }
+    return prev == MAX_BYTES;
+  }
+
+  // 大于 8 字节的 size class 是否都是 16 的倍数，
+  // libhcmalloc 的 malloc 依赖这一点满足 ABI 的 16 字节对齐
+  constexpr bool aligned_to_16() const {
+    for (size_t i = 0; i < N_FREE_LIST; ++i) {
+      if (info_[i].size > 8 && info_[i].size % 16 != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+inline constexpr SizeClassTables kSizeClassTables{};
+
+static_assert(N_FREE_LIST <= 255,
+              "class_index_ 用 uint8_t 存放桶号，页表用 uint8_t 存放桶号 + 1");
+static_assert(kSizeClassTables.verify(), "size class 查表不合法");
+
+#ifdef HC_SIZE_CLASS_TABLE
+static_assert(kSizeClassTables.aligned_to_16(),
+              "生成的表中大于 8 字节的 size class 必须是 16 的倍数");
+#else
+static_assert(N_FREE_LIST == 208, "默认布局应有 208 个桶");
+static_assert(kSizeClassTables.info_[15].size == 128 &&
+                  kSizeClassTables.info_[71].size == 1024 &&
+                  kSizeClassTables.info_[127].size == 8 * 1024 &&
+                  kSizeClassTables.info_[183].size == 64 * 1024 &&
+                  kSizeClassTables.info_[N_FREE_LIST - 1].size == MAX_BYTES,
+              "size class 的区间划分和 208 个桶的布局不一致");
+static_assert(kSizeClassTables.info_[0].num_objects == 512 &&
+                  kSizeClassTables.info_[N_FREE_LIST - 1].num_objects == 2,
+              "批量大小的范围应为 [2, 512]");
+#endif
+
+// size的对齐映射规则，热路径上都是一到两次查表
 class AlignMap {
  public:
-  static size_t align_upwards(size_t size, size_t align);
+  static constexpr size_t align_upwards(size_t size, size_t align) {
+    return (size + align - 1) & ~(align - 1);
+  }
 
-  static size_t align_upwards(size_t size);
+  // 小内存对齐到所属 size class 的大小，大内存按照系统页对齐
+  // 256KB < size <= 128*SYSTEM_PAGE_SIZE 走 page cache
+  // size > 128*SYSTEM_PAGE_SIZE 走 system alloc
+  static constexpr size_t align_upwards(size_t size) {
+    return size <= MAX_BYTES ? class_to_size(hash_bucket_index(size))
+                             : align_upwards(size, SYSTEM_PAGE_SIZE);
+  }
 
-  static size_t hash_bucket_index(size_t size, size_t align_shift);
+  // size 所属的桶号，size 不需要事先对齐，要求 size <= MAX_BYTES
+  static constexpr size_t hash_bucket_index(size_t size) {
+    assert(size <= MAX_BYTES);
+    return kSizeClassTables
+        .class_index_[SizeClassTables::class_array_index(size)];
+  }
 
-  static size_t hash_bucket_index(size_t size);
+  // hash_bucket_index 的逆映射：index 号桶中对象对齐后的大小
+  static constexpr size_t class_to_size(size_t index) {
+    assert(index < N_FREE_LIST);
+    return kSizeClassTables.info_[index].size;
+  }
+
+  // 不小于 size、并且其中每个对象都按 alignment 对齐的 size class 的桶号
+  // alignment 是不超过一页的 2 的幂。span 按页对齐，对象从 span 的起始位置
+  // 依次切分，size class 的大小是 alignment 的倍数时每个对象都是对齐的
+  // 对齐后超过 MAX_BYTES 时返回 N_FREE_LIST
+  static constexpr size_t aligned_bucket_index(size_t size, size_t alignment) {
+    size = align_upwards(size, alignment);
+    if (size > MAX_BYTES) {
+      return N_FREE_LIST;
+    }
+    // 默认的布局中第一次查到的就满足；生成的表可能要再往后找几个
+    size_t index = hash_bucket_index(size);
+    while (class_to_size(index) % alignment != 0) {
+      ++index;
+    }
+    return index;
+  }
 
   // thread cache 一次从 central cache 中获取多少个对象
-  static size_t calculate_num_objects(size_t size);
+  static constexpr size_t calculate_num_objects(size_t size) {
+    return size == 0 ? 0
+                     : kSizeClassTables.info_[hash_bucket_index(size)]
+                           .num_objects;
+  }
 
   // central cache 一次从 page cache 中获取多少个页
-  static size_t calculate_num_pages(size_t size);
+  static constexpr size_t calculate_num_pages(size_t size) {
+    return kSizeClassTables.info_[hash_bucket_index(size)].num_pages;
+  }
+
+  // index 号桶的一个 span 能切分出多少个对象
+  static constexpr size_t span_capacity(size_t index) {
+    return (static_cast<size_t>(kSizeClassTables.info_[index].num_pages)
+            << kPageShift) /
+           kSizeClassTables.info_[index].size;
+  }
+
+  // 所有 size class 中一个 span 最多能切分出的对象数
+  static constexpr size_t max_span_capacity() {
+    size_t capacity = 0;
+    for (size_t i = 0; i < N_FREE_LIST; ++i) {
+      if (span_capacity(i) > capacity) {
+        capacity = span_capacity(i);
+      }
+    }
+    return capacity;
+  }
 };
 
+struct SampleBucket;
+
+// 编译期开关：central cache 用 span 中的位图记录空闲对象，而不是串在对象里的链表
+// 切分 span 和对象归还时只修改 span 的元数据，不写对象所在的内存
+#ifndef HC_SPAN_BITMAP
+#define HC_SPAN_BITMAP 0
+#endif
+
+#if HC_SPAN_BITMAP
+// 空闲对象位图的字数，能放下最大的 span 中的所有对象
+const size_t kSpanBitmapWords = (AlignMap::max_span_capacity() + 63) / 64;
+#endif
+
 // 管理多个连续页的大块内存跨度结构
+// 8 字节的字段在前，其余按大小排列，标志位压缩成一个字节，
+// 默认配置下正好占一个 cache line
 class Span {
  public:
   size_t page_id_ = 0;  // 大块内存的起始页号
-  size_t n_pages_ = 0;  // 大块内存跨度的页数
 
   // Span 结构的双向链表
   Span *next_ = nullptr;
   Span *prev_ = nullptr;
 
-  size_t use_count_ = 0;  // 切分好的小块内存，已分配给 thread cache 的计数
-  size_t obj_size_ = 0;   // 切分好的小块内存的对象大小, 用于释放内存时计算 span
   void *free_list_ = nullptr;  // 切分好的小块内存的空闲链表
 
-  bool is_used_ = false;  // 用于标记是否被使用
+  // 被采样对象独占的 span 指向调用栈所在的桶，释放时据此更新 heap profile
+  SampleBucket *sample_bucket_ = nullptr;
+
+  size_t free_since_ = 0;  // 进入 page cache 的时间（毫秒），用于衰减回收
+
+#if HC_SPAN_BITMAP
+  // 第 i 位为 1 表示第 i 个对象空闲，代替 free_list_
+  uint64_t free_bits_[kSpanBitmapWords] = {};
+  // 2^32 / 对象大小 向上取整，对象的偏移乘以它再右移 32 位就是对象的序号
+  uint32_t obj_reciprocal_ = 0;
+#endif
+
+  uint32_t n_pages_ = 0;    // 大块内存跨度的页数
+  uint32_t use_count_ = 0;  // 切分好的小块内存，已分配给 thread cache 的计数
+
+  // 在 page cache 中所处的桶号（即页数），0 表示不在 page cache 的空闲链表中
+  // 只在持有对应桶锁时修改，合并时用来找到邻居所在的桶
+  std::atomic<uint16_t> page_cache_bucket_{0};
+
+  // 小块内存所属的 size class，对象大小由它查表得到，见 obj_size()
+  uint8_t size_class_ = 0;
+  uint8_t node_ = 0;  // 所属的 NUMA 节点，对象释放时据此找到对应节点的缓存
+
+  // 标志位挤在同一个字节中；C++17 的位域不能有默认初始值，在构造函数中清零
+  // 同一个 span 的标志只由持有它的一方（或者在它所在的桶锁下）修改，
+  // 不会有两个线程同时写同一个字节
+  bool is_used_ : 1;  // 用于标记是否被使用
+  // 整个 span 作为一个对象分配给用户：大内存和对齐超过一页的申请
+  // 释放时整个 span 还给 page cache，不经过 thread cache
+  bool is_large_ : 1;
+  bool returned_ : 1;  // 页是否已经通过 madvise 归还给操作系统
+  // 页的内容是否全为 0：刚从系统映射的页，或者用 MADV_DONTNEED 归还过的页
+  // 用过的 span 回到 page cache 时清除，hc_calloc 据此跳过清零
+  bool zeroed_ : 1;
+
+  Span()
+      : is_used_(false), is_large_(false), returned_(false), zeroed_(false) {}
+
+  // 分配给用户的对象大小：大内存是整个 span，否则是 size class 的大小
+  size_t obj_size() const {
+    return is_large_ ? static_cast<size_t>(n_pages_) << kPageShift
+                     : AlignMap::class_to_size(size_class_);
+  }
 };
 
-// 带头双向循环链表
+#if !HC_SPAN_BITMAP
+static_assert(sizeof(Span) <= kCacheLineSize, "Span 应该放得进一个 cache line");
+#endif
+
+// 轻量自旋锁，用于临界区只有几条指令的场景
+class SpinLock {
+ public:
+  bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void lock() {
+    while (!try_lock()) {
+      std::this_thread::yield();
+    }
+  }
+
+  void unlock() { locked_.store(false, std::memory_order_release); }
+
+ private:
+  std::atomic<bool> locked_{false};
+};
+
+// 先自旋一小段时间，拿不到锁再睡眠等待（Linux 上用 futex，其他平台让出 CPU）
+// 适合临界区只有几百纳秒、多数情况下很快就能拿到锁的场景
+class SpinParkMutex {
+ public:
+  bool try_lock() {
+    uint32_t expected = 0;
+    return state_.compare_exchange_strong(expected, 1,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed);
+  }
+
+  void lock() {
+    for (int i = 0; i < kSpinCount; ++i) {
+      if (state_.load(std::memory_order_relaxed) == 0 && try_lock()) {
+        return;
+      }
+      cpu_relax();
+    }
+    // 2 表示可能有线程在睡眠，解锁时需要唤醒一个
+    while (state_.exchange(2, std::memory_order_acquire) != 0) {
+      futex_wait(&state_, 2);
+    }
+  }
+
+  void unlock() {
+    if (state_.exchange(0, std::memory_order_release) == 2) {
+      futex_wake(&state_);
+    }
+  }
+
+ private:
+  static const int kSpinCount = 100;
+
+  // 0：未加锁；1：已加锁；2：已加锁并且可能有线程在等待
+  std::atomic<uint32_t> state_{0};
+};
+
+// MCS 队列锁：等待的线程按到达顺序在各自的节点上排队，只有队首的线程
+// 访问锁字 locked_，竞争激烈时不会所有线程争抢同一个 cache line
+// 锁不在解锁时直接交给队首，而是像 qspinlock 一样释放锁字，正在运行的线程
+// 可以直接拿到锁；线程数超过 CPU 数时不会每次交接都要等睡眠的队首被调度
+// 排队和在锁字上等待都是先自旋一会儿，之后用 futex 睡眠
+// 节点来自线程局部的小数组，只在 lock() 排队期间使用，返回前就归还
+class McsLock {
+ public:
+  struct Node {
+    std::atomic<Node *> next_{nullptr};
+    // 0：已经排到队首；1：排队中，正在自旋；2：排队中，已经睡眠，需要唤醒
+    std::atomic<uint32_t> state_{0};
+  };
+
+  static const size_t kMaxHeld = 8;
+
+  bool try_lock() {
+    uint32_t expected = 0;
+    return locked_.compare_exchange_strong(expected, 1,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed);
+  }
+
+  void lock();
+
+  void unlock() {
+    if (locked_.exchange(0, std::memory_order_release) == 2) {
+      futex_wake(&locked_);
+    }
+  }
+
+ private:
+  static const int kSpinCount = 100;
+
+  // 0：未加锁；1：已加锁；2：已加锁并且队首可能在睡眠
+  std::atomic<uint32_t> locked_{0};
+  std::atomic<Node *> tail_{nullptr};
+};
+
+// 编译期开关：关闭后所有统计计数器都是空操作
+#ifndef HC_ENABLE_STATS
+#define HC_ENABLE_STATS 1
+#endif
+
+// 编译期开关：hc_free_sized 是否检查传入的大小和 span 中记录的大小一致
+// 默认只在调试版本（没有定义 NDEBUG）中检查
+#ifndef HC_CHECK_SIZED_FREE
+#ifdef NDEBUG
+#define HC_CHECK_SIZED_FREE 0
+#else
+#define HC_CHECK_SIZED_FREE 1
+#endif
+#endif
+
+// 统计计数器，只在持有锁时或者只被一个线程修改，用普通的读-加-写代替原子加
+// 其他线程可以随时读取，读到的值可能略微落后
+class StatCounter {
+ public:
+  void add(size_t n = 1) {
+#if HC_ENABLE_STATS
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+#else
+    (void)n;
+#endif
+  }
+
+  size_t get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<size_t> value_{0};
+};
+
+// 多个线程同时修改的统计计数器，只用在慢路径上
+class SharedStatCounter {
+ public:
+  void add(size_t n = 1) {
+#if HC_ENABLE_STATS
+    value_.fetch_add(n, std::memory_order_relaxed);
+#else
+    (void)n;
+#endif
+  }
+
+  size_t get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<size_t> value_{0};
+};
+
+// 带竞争统计的互斥锁：先 try_lock，失败时才计时并阻塞等待
+// Lock 是实际使用的锁，需要提供 try_lock、lock 和 unlock
+template <class Lock>
+class BasicBucketMutex {
+ public:
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    acquires_.add();
+    return true;
+  }
+
+  void lock() {
+    if (try_lock()) {
+      return;
+    }
+#if HC_ENABLE_STATS
+    auto begin = std::chrono::steady_clock::now();
+    mutex_.lock();
+    auto end = std::chrono::steady_clock::now();
+    // 已经持有锁，计数器不会被其他线程同时修改
+    acquires_.add();
+    contended_.add();
+    wait_ns_.add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+            .count());
+#else
+    mutex_.lock();
+#endif
+  }
+
+  void unlock() { mutex_.unlock(); }
+
+  // 加锁次数、需要等待的次数以及等待的总时间
+  size_t acquires() const { return acquires_.get(); }
+  size_t contended() const { return contended_.get(); }
+  size_t wait_ns() const { return wait_ns_.get(); }
+
+ private:
+  Lock mutex_;
+  StatCounter acquires_;
+  StatCounter contended_;
+  StatCounter wait_ns_;
+};
+
+// 编译期开关：central cache 和 page cache 桶锁的实现
+// 0：std::mutex；1：SpinParkMutex，先自旋再睡眠；2：McsLock，等待者排队的锁
+#ifndef HC_LOCK_POLICY
+#define HC_LOCK_POLICY 0
+#endif
+
+#if HC_LOCK_POLICY == 1
+typedef BasicBucketMutex<SpinParkMutex> BucketMutex;
+#elif HC_LOCK_POLICY == 2
+typedef BasicBucketMutex<McsLock> BucketMutex;
+#else
+typedef BasicBucketMutex<std::mutex> BucketMutex;
+#endif
+
+// 带头双向循环链表，头结点直接嵌在链表中，构造时不申请内存
 class SpanList {
  public:
   SpanList();
+  SpanList(const SpanList &) = delete;
+  SpanList &operator=(const SpanList &) = delete;
   Span *begin();
   Span *end();
 
@@ -110,10 +669,35 @@ class SpanList {
   void push_front(Span *span);
   Span *pop_front();
 
-  std::mutex bucket_lock_;
+ private:
+  Span head_;
+};
+
+// 单例的存储：第一次访问时在静态存储上构造 N 个实例，进程退出时不析构
+// 作为 malloc 使用（LD_PRELOAD）时，其他库的初始化函数可能在本库的静态对象
+// 构造之前就调用 malloc，进程退出时 atexit 函数和其他线程也可能还在释放内存，
+// 所以单例既不能依赖静态初始化的顺序，也不能被析构
+// 构造函数不能调用 malloc/new，T 需要把 LeakyInstances<T, N> 声明为友元
+template <class T, size_t N = 1>
+class LeakyInstances {
+ public:
+  static T *get(size_t i = 0) {
+    static T *instances = construct();
+    assert(i < N);
+    return instances + i;
+  }
+
+  static size_t index_of(const T *instance) { return instance - get(); }
 
  private:
-  Span *head_ = nullptr;
+  static T *construct() {
+    alignas(T) static unsigned char storage[sizeof(T) * N];
+    T *instances = reinterpret_cast<T *>(storage);
+    for (size_t i = 0; i < N; ++i) {
+      new (&instances[i]) T();
+    }
+    return instances;
+  }
 };
 
 #endif  // __HIGH_CONCURRENT_MEMORY_POOL_COMMON_H__
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_CPU_CACHE_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_CPU_CACHE_H__
+#include "common.h"
+#include "thread_cache.h"
+
+// 支持的最大 CPU 编号，超出范围的 CPU 退回到 thread cache
+const size_t MAX_CPUS = 1024;
+
+// per-CPU 前端缓存：每个 CPU 一份 ThreadCache，线程数再多，缓存的份数也只和核数相关
+// 当前 CPU 号通过 Linux rseq (restartable sequences) 的 cpu_id 字段读取，
+// rseq 不可用时 enabled() 为 false，hc_malloc/hc_free 继续使用 thread cache
+// 注意这里不是 rseq 临界区：rseq 只用来读 CPU 号，每个槽由一把自旋锁保护，
+// 读完 CPU 号之后线程可能被迁移或抢占，所以只 try_lock；槽被占用时
+// （通常是持有者在临界区内被抢占了）不等待，改用调用线程自己的 thread cache
+class CpuCache {
+ public:
+  // 单例模式
+  static CpuCache* GetInstance();
+
+  // 开启或关闭 per-CPU 缓存，返回是否处于开启状态
+  bool set_enabled(bool enable);
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  void* allocate(size_t size);
+
+  void deallocate(void* ptr, size_t size);
+
+  // 当前线程所在的 CPU 号，rseq 不可用时返回 -1
+  static int current_cpu();
+
+ private:
+  CpuCache() = default;
+  CpuCache(const CpuCache&) = delete;
+  CpuCache& operator=(const CpuCache&) = delete;
+
+  // 每个 CPU 一个槽，独占 cache line 避免伪共享
+  struct alignas(64) Slot {
+    SpinLock lock_;
+    ThreadCache cache_;
+  };
+
+  // 获取 cpu 对应的槽，第一次访问时才分配
+  Slot* get_slot(int cpu);
+
+ private:
+  std::atomic<bool> enabled_{false};
+  std::atomic<Slot*> slots_[MAX_CPUS] = {};
+  static CpuCache cpu_cache_instance_;
+};
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_CPU_CACHE_H__
@@ -0,0 +1,88 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_HEAP_PROFILER_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_HEAP_PROFILER_H__
+#include "common.h"
+
+// 默认每分配这么多字节采样一次，0 表示关闭
+const size_t DEFAULT_SAMPLE_RATE = 512 * 1024;
+
+// 采样关闭时，thread cache 每分配这么多字节检查一次是否重新开启
+const size_t SAMPLE_RECHECK_BYTES = 16 * 1024 * 1024;
+
+// 每个调用栈最多记录的帧数
+const size_t MAX_STACK_DEPTH = 32;
+
+// 最多记录的不同调用栈个数，超出后的样本都计入一个没有调用栈的桶
+const size_t MAX_SAMPLE_BUCKETS = 4096;
+
+// 同一个调用栈上所有样本的累计
+struct SampleBucket {
+  size_t hash_ = 0;
+  size_t depth_ = 0;
+  void* stack_[MAX_STACK_DEPTH] = {};
+  size_t alloc_count_ = 0;  // 累计采样到的申请次数
+  size_t alloc_bytes_ = 0;
+  size_t free_count_ = 0;   // 其中已经释放的次数
+  size_t free_bytes_ = 0;
+  SampleBucket* next_ = nullptr;  // 哈希表中同一个槽的链表
+};
+
+// 采样堆分析器
+// thread cache 每分配约 sample_rate 字节（按几何分布随机）采样一次：
+// 被采样的对象单独占用一个按页申请的 span，span 上记录调用栈所在的桶，
+// hc_free 查到 span 时顺便检查这个标记，未被采样的对象不会多加任何锁
+// 输出 gperftools 的 heap profile 文本格式（heap_v2），可以直接交给 pprof
+class HeapProfiler {
+ public:
+  // 单例模式
+  static HeapProfiler* GetInstance();
+
+  // 设置采样间隔（字节），0 表示关闭
+  void set_sample_rate(size_t rate) {
+    sample_rate_.store(rate, std::memory_order_relaxed);
+  }
+  size_t sample_rate() const {
+    return sample_rate_.load(std::memory_order_relaxed);
+  }
+
+  // 下一次采样前还要分配的字节数，服从均值为 sample_rate 的几何分布
+  size_t next_sample_interval();
+
+  // 申请一个被采样的对象，单独占用一个 span
+  // 正在采样（例如获取调用栈时又申请了内存）时返回 nullptr，由调用方正常申请
+  void* allocate_sampled(size_t size);
+
+  // 大内存的申请路径上调用，到了采样间隔时记录这个 span
+  void maybe_sample_large(Span* span, size_t size);
+
+  // 释放被采样的对象，span 还给 page cache（大内存 span 直接还给系统）
+  void release_sampled(Span* span);
+
+  // 输出 heap profile：每个调用栈的存活对象（inuse）和累计申请（alloc），
+  // 末尾附上 /proc/self/maps。返回是否写入成功
+  bool dump(int fd);
+
+ private:
+  HeapProfiler() = default;
+  HeapProfiler(const HeapProfiler&) = delete;
+  HeapProfiler& operator=(const HeapProfiler&) = delete;
+
+  // 获取当前调用栈，记到对应的桶上，需要持有 lock_
+  SampleBucket* record_locked(void** stack, size_t depth, size_t bytes);
+
+  // 获取调用栈，skip 为跳过的分析器内部帧数
+  static size_t capture_stack(void** stack, size_t skip);
+
+ private:
+  std::atomic<size_t> sample_rate_{DEFAULT_SAMPLE_RATE};
+  std::atomic<long long> large_bytes_until_sample_{0};
+
+  std::mutex lock_;
+  SampleBucket** table_ = nullptr;    // 哈希表，首次采样时向系统申请
+  SampleBucket* buckets_ = nullptr;   // 桶的存储
+  size_t used_buckets_ = 0;
+  SampleBucket overflow_bucket_;      // 桶用完之后的样本
+
+  static HeapProfiler heap_profiler_instance_;
+};
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_HEAP_PROFILER_H__
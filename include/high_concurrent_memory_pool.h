@@ -3,11 +3,123 @@
 
 #include "central_cache.h"
 #include "common.h"
+#include "cpu_cache.h"
+#include "heap_profiler.h"
+#include "numa.h"
 #include "object_pool.h"
 #include "page_cache.h"
+#include "scavenger.h"
+#include "size_class_tuner.h"
+#include "stats.h"
 #include "thread_cache.h"
 
 void* hc_malloc(size_t size);
 void hc_free(void* ptr);
 
+// 申请 num 个 size 字节的对象并清零，num * size 溢出时抛出 std::bad_alloc
+// 大内存的页已知全为 0（刚从系统映射或者刚归还过）时不再清零
+void* hc_calloc(size_t num, size_t size);
+
+// 一次申请 n 个 size 字节的对象，放到 out[0, n) 中，比逐个调用 hc_malloc 快
+// 小对象直接从 thread cache 的自由链表和 central cache 整批取出
+// 申请失败时抛出 std::bad_alloc，已经申请到的对象会被释放
+void hc_malloc_batch(size_t size, size_t n, void** out);
+
+// 一次释放 ptrs[0, n) 中的对象，大小可以各不相同，nullptr 会被跳过
+// 相邻的同一个 size class 的对象整段放进 thread cache，
+// 还给 central cache 时每段只加一次锁
+void hc_free_batch(void** ptrs, size_t n);
+
+// 已知对象大小时的释放，size 必须和申请时的大小相同（或者属于同一个 size class）
+// 直接由 size 得到 size class，不查页表也不读 span；
+// 编译时定义 HC_CHECK_SIZED_FREE=1（调试版本默认开启）会检查 size 是否正确
+void hc_free_sized(void* ptr, size_t size);
+
+// 按 alignment 对齐申请，alignment 必须是 2 的幂，返回的指针直接用 hc_free 释放
+// 不超过一页的对齐从对象天然对齐的 size class 中分配，不额外占用内存；
+// 超过一页的对齐从 page cache 中切出起始地址对齐的 span
+void* hc_aligned_alloc(size_t alignment, size_t size);
+
+// 同 hc_aligned_alloc
+void* hc_memalign(size_t alignment, size_t size);
+
+// 把 ptr 调整为 size 字节，返回的指针可能和 ptr 不同，前 min(原大小, size)
+// 字节的内容保持不变。size 仍属于原来的 size class 时直接返回 ptr；
+// 大内存尽量原地调整：吞并后面空闲的页，超过 128 页时用 mremap 重新映射
+// ptr 为 nullptr 时等同于 hc_malloc，size 为 0 时释放 ptr 并返回 nullptr
+void* hc_realloc(void* ptr, size_t size);
+
+// ptr 实际可用的字节数（不小于申请时的大小），ptr 为 nullptr 时返回 0
+size_t hc_malloc_usable_size(void* ptr);
+
+// 开启/关闭基于 rseq 的 per-CPU 前端缓存，返回是否开启成功
+// rseq 不可用时返回 false，继续使用 thread cache
+bool hc_set_per_cpu_cache(bool enable);
+
+// 启动/停止后台回收线程：每 interval_ms 把 page cache 中空闲超过 decay_ms
+// 的 span 归还给操作系统
+void hc_scavenger_start(size_t interval_ms, size_t decay_ms);
+void hc_scavenger_stop();
+
+// 不启动线程，在释放 span 的慢路径上每隔 interval_ms 顺便回收一次
+// interval_ms 为 0 表示关闭
+void hc_set_lazy_scavenge(size_t interval_ms, size_t decay_ms);
+
+// 回收时使用 MADV_FREE 代替 MADV_DONTNEED
+void hc_set_scavenge_madv_free(bool enable);
+
+// 开启大页模式：之后 page cache 按 2MB 对齐向系统申请内存并使用透明大页，
+// 回收时只整块归还空闲的大页。平台不支持时返回 false
+bool hc_set_hugepage_mode(bool enable);
+
+// 大页区域占用的字节数，以及其中已经整块归还给操作系统的字节数
+void hc_get_hugepage_stats(size_t* reserved_bytes, size_t* released_bytes);
+
+// 开启/关闭 NUMA 感知：每个节点一份 central cache 和 page cache，
+// 线程使用所在节点的实例，释放的对象回到 span 所属的节点。单节点机器上等同于关闭
+// simulated_nodes 不为 0 时按线程轮流模拟这么多个节点，用于测试
+bool hc_set_numa_aware(bool enable, size_t simulated_nodes = 0);
+
+// 当前使用的节点数
+size_t hc_numa_node_count();
+
+// 把当前线程 thread cache 中缓存的对象全部归还给 central cache，
+// 返回归还的字节数。per-CPU 缓存不属于某个线程，不受影响
+size_t hc_thread_cache_flush();
+
+// 线程将要长时间空闲时调用：归还并销毁当前线程的 thread cache，
+// 线程再次申请内存时重新创建
+void hc_thread_idle();
+
+// 设置所有 thread cache 合计最多缓存的字节数（默认 32MB），按线程数平分
+// 之后缓存超出上限的线程从空闲线程那里偷预算，超出上限的缓存会归还一部分对象
+void hc_set_thread_cache_budget(size_t bytes);
+
+// 全局预算、未分配的预算以及所有 thread cache 的缓存情况
+ThreadCacheStats hc_get_thread_cache_stats();
+
+// 当前线程 thread cache 缓存的字节数和字节上限
+void hc_get_thread_cache_usage(size_t* cached_bytes, size_t* limit_bytes);
+
+// 汇总各层的统计：每个 size class 的申请/释放/命中次数、各层缓存的字节数、
+// span 的申请和合并次数以及锁竞争。计数器在各线程和各层中分散维护，读取时汇总，
+// 编译时定义 HC_ENABLE_STATS=0 可以去掉所有计数
+void hc_get_stats(HcStats* stats);
+
+// 把统计格式化成可读的文本写入 buf，不申请内存
+// 返回完整输出需要的长度，不小于 len 时说明被截断了
+size_t hc_format_stats(char* buf, size_t len);
+
+// 设置堆采样的平均间隔（字节），默认 512KB，0 表示关闭
+void hc_set_sample_rate(size_t bytes);
+size_t hc_get_sample_rate();
+
+// 把采样得到的 heap profile 写入 path，格式和 gperftools 相同，可以用 pprof 查看：
+// 每个调用栈的存活对象（--inuse_space）和累计申请（--alloc_space）
+bool hc_dump_heap_profile(const char* path);
+
+// 空闲时调用：把 transfer cache 和 page cache 中的空闲内存全部归还给操作系统
+// 返回归还的字节数
+size_t hc_trim();
+
 #endif  // __HIGH_CONCURRENT_MEMORY_POOL_H__
\ No newline at end of file
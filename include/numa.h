@@ -0,0 +1,48 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_NUMA_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_NUMA_H__
+#include "common.h"
+
+// 支持的最大 NUMA 节点数，每个节点一份 central cache 和 page cache
+const size_t MAX_NUMA_NODES = 8;
+
+// NUMA 拓扑和线程到节点的路由
+// 默认关闭，所有线程都使用 0 号节点的 central cache 和 page cache；
+// 开启后线程使用所在节点的实例，page cache 向系统申请的内存用 mbind 绑定到该节点
+class Numa {
+ public:
+  // 单例模式
+  static Numa* GetInstance();
+
+  // 开启/关闭 NUMA 感知，返回是否处于开启状态
+  // simulated_nodes 不为 0 时不读取系统拓扑，按线程轮流分配到模拟的节点上，
+  // 也不调用 mbind，用于在单节点机器上测试跨节点的逻辑
+  bool set_enabled(bool enable, size_t simulated_nodes = 0);
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // 节点数，未开启时为 1
+  size_t node_count() const {
+    return node_count_.load(std::memory_order_relaxed);
+  }
+
+  // 当前线程所在的节点，未开启时为 0
+  size_t current_node() const;
+
+  // 把 [ptr, ptr + page_count 页) 的物理内存优先分配在 node 上
+  void bind(void* ptr, size_t page_count, size_t node) const;
+
+ private:
+  Numa() = default;
+  Numa(const Numa&) = delete;
+  Numa& operator=(const Numa&) = delete;
+
+  // 读取 /sys/devices/system/node/possible 得到系统的节点数
+  static size_t detect_node_count();
+
+ private:
+  std::atomic<bool> enabled_{false};
+  std::atomic<bool> simulated_{false};
+  std::atomic<size_t> node_count_{1};
+  static Numa numa_instance_;
+};
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_NUMA_H__
@@ -22,10 +22,15 @@ class ObjectPool {
       size_type obj_size =
           sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*);
       if (remain_size_ < obj_size) {
+        // 块头记录块的大小并把所有块串起来，析构时归还，不依赖 std::vector
+        // 内存池本身可能就是 malloc 的实现，这里不能使用全局的 new
         void* block = system_alloc(current_block_size_);
-        memory_blocks_.push_back(std::make_pair(block, current_block_size_));
-        current_ = static_cast<char*>(block);
-        remain_size_ = current_block_size_ << kPageShift;
+        BlockHeader* header = static_cast<BlockHeader*>(block);
+        header->next_ = blocks_;
+        header->page_count_ = current_block_size_;
+        blocks_ = header;
+        current_ = static_cast<char*>(block) + kHeaderSize;
+        remain_size_ = (current_block_size_ << kPageShift) - kHeaderSize;
 
         // 每次1.5倍增长，直到最大页面数
         if (current_block_size_ < max_block_size_) {
@@ -50,7 +55,11 @@ class ObjectPool {
     free_list_ = obj;
   }
 
-  ObjectPool() : current_(nullptr), remain_size_(0), free_list_(nullptr) {
+  ObjectPool()
+      : current_(nullptr),
+        remain_size_(0),
+        free_list_(nullptr),
+        blocks_(nullptr) {
     // 初始化页面大小是对象页面对齐数，以后每次1.5倍增长，直到最大页面数
     initial_block_size_ =
         AlignMap::align_upwards(sizeof(T), SYSTEM_PAGE_SIZE) >> kPageShift;
@@ -59,16 +68,26 @@ class ObjectPool {
   }
 
   ~ObjectPool() {
-    for (auto& block : memory_blocks_) {
-      system_dealloc(block.first, block.second);
+    while (blocks_ != nullptr) {
+      BlockHeader* next = blocks_->next_;
+      system_dealloc(blocks_, blocks_->page_count_);
+      blocks_ = next;
     }
   }
 
  private:
+  // 每个块开头的块头，对象从块头之后开始切分
+  struct BlockHeader {
+    BlockHeader* next_;
+    size_type page_count_;
+  };
+  static constexpr size_type kHeaderSize =
+      alignof(T) > sizeof(BlockHeader) ? alignof(T) : sizeof(BlockHeader);
+
   char* current_;
   size_type remain_size_;
   void* free_list_;
-  std::vector<std::pair<void*, size_type>> memory_blocks_;
+  BlockHeader* blocks_;
 
   // 慢启动分配策略 以页面为单位
   size_type initial_block_size_;
@@ -76,67 +95,4 @@ class ObjectPool {
   size_type max_block_size_;
 };
 
-class Fixed256KBlockPool {
- public:
-  static constexpr size_t BLOCK_SIZE = 256 * 1024;  // 256KB
-  static constexpr size_t PAGES_PER_BLOCK = 64;
-
-  Fixed256KBlockPool() : free_list_(nullptr), allocated_blocks_(0) {}
-
-  ~Fixed256KBlockPool() {
-    for (auto& block : blocks_) {
-      system_dealloc(block, PAGES_PER_BLOCK);
-    }
-  }
-
-  // 分配一个256KB块
-  void* New() {
-    // 优先从空闲链表获取
-    if (free_list_) {
-      void* block = free_list_;
-      free_list_ = *static_cast<void**>(free_list_);
-      return block;
-    }
-
-    // 需要分配新块
-    void* new_block = system_alloc(PAGES_PER_BLOCK);
-    if (!new_block) {
-      throw std::bad_alloc();
-    }
-
-    blocks_.push_back(new_block);
-    allocated_blocks_++;
-    return new_block;
-  }
-
-  // 释放一个256KB块
-  void Delete(void* block) {
-    if (!block) return;
-
-    // 加入空闲链表
-    *static_cast<void**>(block) = free_list_;
-    free_list_ = block;
-  }
-
-  // 统计信息
-  size_t GetAllocatedBlocks() const { return allocated_blocks_; }
-  size_t GetFreeBlocks() const {
-    size_t count = 0;
-    for (void* p = free_list_; p; p = *static_cast<void**>(p)) {
-      count++;
-    }
-    return count;
-  }
-
- private:
-  // 内存块列表
-  std::vector<void*> blocks_;
-
-  // 空闲链表
-  void* free_list_;
-
-  // 已分配块数
-  size_t allocated_blocks_;
-};
-
 #endif  // __HIGH_CONCURRENT_MEMORY_POOL_OBJECT_POOL_H__
\ No newline at end of file
@@ -1,41 +1,173 @@
 #ifndef __HIGH_CONCURRENT_MEMORY_POOL_PAGE_CACHE_H__
 #define __HIGH_CONCURRENT_MEMORY_POOL_PAGE_CACHE_H__
 #include "common.h"
+#include "numa.h"
 #include "object_pool.h"
 #include "page_map.h"
+#include "stats.h"
 
+// 大页模式下一次向系统申请的 2MB 对齐区域
+// 每个区域按 128 页切成若干 span 放进 page cache，区域内的 span 不和区域外合并
+struct HugeRegion {
+  size_t first_page_ = 0;                // 区域的起始页号
+  std::atomic<size_t> free_pages_{0};    // 区域中挂在 page cache 桶里的页数
+  std::atomic<bool> released_{false};    // 整个区域是否已经归还给操作系统
+  HugeRegion* next_ = nullptr;           // 所有区域串成单链表，只增不减
+};
+
+// page cache 的一个页数桶：空闲 span 链表和保护它的锁
+// 按 cache line 对齐，不同页数的桶被不同线程加锁时不会伪共享
+struct alignas(kCacheLineSize) PageBucket : public SpanList {
+  BucketMutex bucket_lock_;
+};
+
+// page cache 没有全局锁，每个页数桶（PageBucket）用自己的 bucket_lock_ 保护，
+// 相当于按页数把 page heap 分成了 N_PAGES_BUCKET 个分片
+// 桶命中时只需要加这一个桶的锁；跨桶的合并通过 Span::page_cache_bucket_
+// 找到邻居所在的桶，加锁后再次确认邻居还在桶里才摘下来
+// 每个 NUMA 节点一个实例，页号到 span 的映射所有节点共用
 class PageCache {
  public:
-  // 单例模式
+  // 单例模式，返回当前线程所在节点的实例
   static PageCache* GetInstance();
+  static PageCache* GetInstance(size_t node);
+
+  // 实例所属的 NUMA 节点
+  size_t node() const { return Instances::index_of(this); }
 
   // 从 page cache 中获取一个包含 page_count 个 page 的 span
+  // 内部按桶加锁，调用方不需要加锁
   Span* new_span(size_t page_count);
 
-  std::mutex page_cache_lock_;
-  static PageCache page_cache_instance_;
+  // 获取一个起始页号是 align_pages 的倍数的 span，align_pages 是 2 的幂
+  // 优先从桶里已有的空闲 span 中切出对齐的部分；找不到时多申请
+  // align_pages - 1 页，再把首尾多出的页切下来还回去
+  Span* new_aligned_span(size_t page_count, size_t align_pages);
+
+  // 把正在使用的大内存 span 原地调整为 page_count 页，内容保持不变
+  // 桶里的 span 缩小时把尾部还回 page cache，增大时吞并紧挨在后面的空闲 span；
+  // 超过 128 页的 span 用 system_realloc 重新映射，起始地址可能改变
+  // 无法原地调整时返回 false，span 保持不变。span 必须属于本节点
+  bool resize_span(Span* span, size_t page_count);
+
+  // 通过地址获取页号，进而获取 span，span 可能属于任意节点
+  static Span* get_span_by_address(void* ptr);
+
+  // 在页表中记录小对象 span 每一页的 size class，hc_free 据此得到对象大小，
+  // 不需要访问 span；span 不再切分小对象（还给 page cache）之前要清除
+  static void map_size_class(Span* span);
+  static void unmap_size_class(Span* span);
 
-  // 通过地址获取页号，进而获取 span
-  Span* get_span_by_address(void* ptr);
+  // ptr 所在页记录的 size class，不是 central cache 切分的小对象时返回 false
+  static bool get_size_class(void* ptr, size_t& index);
 
-  // 将 central cache 中的 span 归还给 page cache
+  // 将 central cache 中的 span 归还给 page cache，内部按桶加锁
   void release_span_to_page_cache(Span* span);
 
+  // 一次归还 n 个 span，空闲时间共用一个时间戳，最后只检查一次是否需要回收
+  void release_spans(Span* const* spans, size_t n);
+
+  // 把空闲超过 decay_ms 且还没有归还的 span 的物理页归还给操作系统
+  // 返回本次归还的字节数
+  size_t release_free_spans(size_t decay_ms, bool lazy);
+
+  // 开启大页模式：之后向系统申请的内存按 2MB 对齐并使用透明大页
+  // 平台不支持时返回 false
+  bool set_hugepage_mode(bool enable);
+
+  // 大页区域占用的字节数，以及其中整块归还给操作系统的字节数
+  size_t hugepage_reserved_bytes() const;
+  size_t hugepage_released_bytes() const;
+
+  // 把本实例的空闲页、计数器和锁竞争累加到 stats 中
+  void collect_stats(HcStats& stats);
+
  private:
+  friend class LeakyInstances<PageCache, MAX_NUMA_NODES>;
+  typedef LeakyInstances<PageCache, MAX_NUMA_NODES> Instances;
+
+  static const size_t kAlignedScanLimit = 16;
+
   PageCache() = default;
   PageCache(const PageCache&) = delete;
   PageCache& operator=(const PageCache&) = delete;
 
+  // 从 bucket 号桶中取出一个 span，桶为空时返回 nullptr
+  Span* pop_span(size_t bucket);
+
+  // 在不小于 page_count 的桶中找一个包含 page_count 个对齐页的空闲 span，
+  // 从桶中摘下来返回；每个桶最多看 kAlignedScanLimit 个，找不到时返回 nullptr
+  Span* take_aligned_free_span(size_t page_count, size_t align_pages);
+
+  // 把空闲 span 挂到对应页数的桶中
+  void push_span(Span* span);
+
+  // 把不再使用的 span 和前后的空闲页合并后挂进桶中，超过 128 页的直接还给系统
+  // now 记为 span 进入 page cache 的时间
+  void insert_free_span(Span* span, size_t now);
+
+  // 从 span 头部切下 page_count 页返回，剩余部分挂回 page cache
+  Span* split_span(Span* span, size_t page_count);
+
+  // 把页号为 page_id 的空闲邻居从 page cache 中摘下来，用于和 span 合并
+  // 邻居不存在、正在使用、属于其他节点或者合并后超过 128 页时返回 nullptr
+  Span* take_neighbour(size_t page_id, Span* span, bool is_prev);
+
+  // boundary 是某个大页区域的边界时返回 true，区域内外的 span 不能合并
+  bool is_region_boundary(size_t boundary) const;
+
+  // 加上 candidate 所在桶的锁，确认它仍在桶里并且满足 match 后摘下来
+  template <class Match>
+  Span* take_free_span(Span* candidate, Match match);
+
+  // 向系统申请 page_count 页并绑定到本节点
+  void* node_alloc(size_t page_count);
+
+  // 向系统申请一个大页区域，返回区域中第一个 128 页的 span，其余挂进桶中
+  Span* new_huge_region();
+
+  // 页所属的大页区域，不在大页区域中返回 nullptr
+  HugeRegion* region_of(size_t page_id) const;
+
+  // 把整块空闲并且空闲超过 decay_ms 的大页区域归还给操作系统
+  size_t release_free_regions(size_t now, size_t decay_ms, bool lazy);
+
+  // 建立 span 所有页（或者首尾页）和 span 的映射
+  void map_span_pages(Span* span);
+  void map_span_bounds(Span* span);
+
+  // span 对象池不是线程安全的，单独加锁
+  Span* new_span_object();
+  void delete_span_object(Span* span);
+
  private:
-  SpanList span_lists_[N_PAGES_BUCKET];
+  PageBucket span_lists_[N_PAGES_BUCKET];
   // std::unordered_map<size_t, Span*> page_id_span_map_;
   // TCMalloc_PageMap2<48 - kPageShift> page_id_span_map_;  // kPageShift=12
   // TCMalloc_PageMap3<32 - kPageShift> page_id_span_map_{system_alloc};
 
-  PageMap<48 - kPageShift> page_id_span_map_;
+  static PageMap<48 - kPageShift> page_id_span_map_;
 
   // span 对象的申请和释放都是在 page cache 中进行的
+  std::mutex span_pool_lock_;
   ObjectPool<Span> span_pool_;
+
+  // 大页模式
+  std::atomic<bool> hugepage_mode_{false};
+  std::mutex region_lock_;  // 保护区域链表和区域对象池
+  HugeRegion* regions_ = nullptr;
+  ObjectPool<HugeRegion> region_pool_;
+  static PageMap<48 - kHugePageShift> region_map_;  // 大页号 -> 区域
+  std::atomic<size_t> region_count_{0};
+  std::atomic<size_t> released_region_count_{0};
+
+  SharedStatCounter new_spans_;
+  SharedStatCounter splits_;
+  SharedStatCounter coalesces_;
+  SharedStatCounter system_allocs_;
+  SharedStatCounter system_deallocs_;
+  SharedStatCounter system_alloc_bytes_;
+  SharedStatCounter system_dealloc_bytes_;
 };
 
-#endif  // __HIGH_CONCURRENT_MEMORY_POOL_PAGE_CACHE_H__
\ No newline at end of file
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_PAGE_CACHE_H__
@@ -200,6 +200,10 @@ class TCMalloc_PageMap3 {
 };
 
 // 两级页表实现
+// 根节点数组在静态存储区（bss）中，叶节点在第一次 set 时才创建，
+// 都只有写到的页才会真正分配物理内存，进程启动时不需要初始化
+// get 不加锁：叶节点指针和值都用 release 写入、acquire 读取，
+// 读到 span 指针时也能看到写入指针之前对 span 的初始化
 template <size_t BITS>
 class PageMap {
  private:
@@ -211,31 +215,35 @@ class PageMap {
   static constexpr size_t kRootBits = BITS - kLeafBits;
   static constexpr size_t kRootLength = 1 << kRootBits;
 
-  // 叶节点结构
+  // 叶节点结构，全 0 的内存就是所有值都为 nullptr、所有 size class 都为 0 的叶节点
+  // size_classes 和 values 平行，每页一个字节，读取时不需要访问 values 指向的对象
   struct Leaf {
-    void* values[kLeafLength];
-
-    Leaf() { memset(values, 0, sizeof(values)); }
+    std::atomic<void*> values[kLeafLength];
+    std::atomic<uint8_t> size_classes[kLeafLength];
   };
+  static_assert(sizeof(Leaf) % SYSTEM_PAGE_SIZE == 0, "叶节点按页申请");
 
-  Leaf* root_[kRootLength];  // 根节点数组
+  std::atomic<Leaf*> root_[kRootLength] = {};  // 根节点数组
+  std::mutex leaf_lock_;                       // 创建叶节点时加锁
 
  public:
   typedef uintptr_t Number;
 
-  PageMap() { memset(root_, 0, sizeof(root_)); }
+  // 可以常量初始化：静态的页表在任何 malloc 调用之前就已经可用
+  constexpr PageMap() = default;
 
-  // 获取页面对应的指针
+  // 获取页面对应的指针，不需要加锁
   void* get(Number k) const {
     if (k >> BITS) return nullptr;  // 超出范围
 
     const Number i1 = k >> kLeafBits;
     const Number i2 = k & (kLeafLength - 1);
 
-    if (i1 >= kRootLength || root_[i1] == nullptr) {
+    Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+    if (leaf == nullptr) {
       return nullptr;
     }
-    return root_[i1]->values[i2];
+    return leaf->values[i2].load(std::memory_order_acquire);
   }
 
   // 设置页面对应的指针（自动分配所需内存）
@@ -245,18 +253,66 @@ class PageMap {
     const Number i1 = k >> kLeafBits;
     const Number i2 = k & (kLeafLength - 1);
 
-    if (root_[i1] == nullptr) {
-      /*static ObjectPool<Leaf> leafPool;
-      Leaf* leaf = (Leaf*)leafPool.New();
-      root_[i1] = leaf;*/
+    ensure_leaf(i1)->values[i2].store(v, std::memory_order_release);
+  }
+
+  // 页面记录的 size class，没有记录过或者叶节点不存在时返回 0，不需要加锁
+  // 调用方已经通过其他同步拿到了页中的对象，size class 在那之前写入，用 relaxed 即可
+  uint8_t get_size_class(Number k) const {
+    if (k >> BITS) return 0;  // 超出范围
+
+    Leaf* leaf = root_[k >> kLeafBits].load(std::memory_order_acquire);
+    if (leaf == nullptr) {
+      return 0;
+    }
+    return leaf->size_classes[k & (kLeafLength - 1)].load(
+        std::memory_order_relaxed);
+  }
 
-      static Fixed256KBlockPool leafPool;
-      Leaf* leaf = (Leaf*)leafPool.New();
-      memset(leaf, 0, sizeof(Leaf));
-      root_[i1] = leaf;
+  // 把 [start, start + n) 每一页的 size class 设为 size_class
+  void set_size_class(Number start, size_t n, uint8_t size_class) {
+    assert(((start + n - 1) >> BITS) == 0);
+    for (Number k = start; k < start + n; ++k) {
+      ensure_leaf(k >> kLeafBits)
+          ->size_classes[k & (kLeafLength - 1)]
+          .store(size_class, std::memory_order_relaxed);
     }
+  }
 
-    root_[i1]->values[i2] = v;
+  // 预先创建 [start, start + n) 所在的叶节点，之后对这些页的 set 不用再加锁
+  // 范围超出页表时返回 false
+  bool reserve(Number start, size_t n) {
+    if (n == 0) {
+      return true;
+    }
+    Number last = start + n - 1;
+    if (last < start || (last >> BITS) != 0) {
+      return false;
+    }
+    for (Number i1 = start >> kLeafBits; i1 <= (last >> kLeafBits); ++i1) {
+      ensure_leaf(i1);
+    }
+    return true;
+  }
+
+ private:
+  // i1 号叶节点，不存在时创建
+  Leaf* ensure_leaf(Number i1) {
+    Leaf* leaf = root_[i1].load(std::memory_order_acquire);
+    if (leaf != nullptr) {
+      return leaf;
+    }
+
+    // page cache 的各个桶并发调用 set，创建叶节点需要加锁
+    std::lock_guard<std::mutex> lock(leaf_lock_);
+    leaf = root_[i1].load(std::memory_order_relaxed);
+    if (leaf == nullptr) {
+      // 叶节点不会释放，直接向系统申请，新映射的页全为 0，
+      // 不需要清零，清零反而会让整个叶节点的页都分配物理内存
+      leaf = static_cast<Leaf*>(system_alloc(sizeof(Leaf) >> kPageShift));
+      root_[i1].store(leaf, std::memory_order_release);
+    }
+    return leaf;
   }
 };
 
@@ -0,0 +1,56 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_SCAVENGER_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_SCAVENGER_H__
+#include <condition_variable>
+
+#include "common.h"
+
+// 把 page cache 中长时间空闲的 span 归还给操作系统
+// 可以启动一个后台线程周期性回收，也可以在释放 span 的慢路径上顺便回收
+class Scavenger {
+ public:
+  // 单例模式
+  static Scavenger* GetInstance();
+
+  // 启动后台线程，每 interval_ms 回收一次空闲超过 decay_ms 的 span
+  void start(size_t interval_ms, size_t decay_ms);
+  void stop();
+
+  // 不启动线程，距离上次回收超过 interval_ms 时在慢路径上顺便回收
+  // interval_ms 为 0 表示关闭
+  void set_lazy(size_t interval_ms, size_t decay_ms);
+
+  // 慢路径上调用，未开启 lazy 回收时只有一次原子读
+  void maybe_scavenge();
+
+  // 使用 MADV_FREE 代替 MADV_DONTNEED
+  void set_madv_free(bool enable);
+
+  // 立即回收空闲超过 decay_ms 的 span，返回归还的字节数
+  size_t scavenge(size_t decay_ms);
+
+ private:
+  friend class LeakyInstances<Scavenger>;
+
+  // 单例不析构，后台线程在进程退出时随进程结束
+  Scavenger() = default;
+  Scavenger(const Scavenger&) = delete;
+  Scavenger& operator=(const Scavenger&) = delete;
+
+  void run(size_t interval_ms, size_t decay_ms);
+
+ private:
+  std::mutex thread_lock_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  bool running_ = false;
+
+  std::atomic<size_t> lazy_interval_ms_{0};
+  std::atomic<size_t> lazy_decay_ms_{0};
+  std::atomic<size_t> last_scavenge_ms_{0};
+  std::atomic<bool> madv_free_{false};
+};
+
+// 单调时钟的毫秒数
+size_t monotonic_ms();
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_SCAVENGER_H__
@@ -0,0 +1,58 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_SIZE_CLASS_TUNER_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_SIZE_CLASS_TUNER_H__
+#include "common.h"
+
+// 每个 size class 统计这么多次 refill/overflow 事件后调整一次批量大小
+const size_t TUNE_WINDOW = 128;
+
+// 每个 size class 的批量大小（thread cache 和 central cache 之间一次移动的对象数）
+// 初始值为 AlignMap::calculate_num_objects，之后根据所有线程的反馈调整：
+// refill（thread cache 为空去 central cache 取）明显多于 overflow（自由链表过长
+// 还给 central cache）时加倍，反之减半，范围是初始值的 [1/4, 4] 倍
+class SizeClassTuner {
+ public:
+  // 单例模式
+  static SizeClassTuner* GetInstance();
+
+  // index 号 size class 当前的批量大小
+  size_t batch_size(size_t index) const {
+    return classes_[index].batch_.load(std::memory_order_relaxed);
+  }
+
+  // thread cache 的 index 号自由链表为空，需要从 central cache 取
+  void record_refill(size_t index) { record(index, true); }
+
+  // thread cache 的 index 号自由链表过长，需要还给 central cache
+  void record_overflow(size_t index) { record(index, false); }
+
+  // 批量大小的上下限
+  size_t min_batch_size(size_t index) const {
+    return classes_[index].min_batch_;
+  }
+  size_t max_batch_size(size_t index) const {
+    return classes_[index].max_batch_;
+  }
+
+ private:
+  friend class LeakyInstances<SizeClassTuner>;
+
+  SizeClassTuner();
+  SizeClassTuner(const SizeClassTuner&) = delete;
+  SizeClassTuner& operator=(const SizeClassTuner&) = delete;
+
+  void record(size_t index, bool refill);
+
+  // 每个 size class 独占 cache line，避免不同 size class 的计数互相干扰
+  struct alignas(64) Class {
+    std::atomic<size_t> batch_{0};
+    std::atomic<size_t> refills_{0};
+    std::atomic<size_t> overflows_{0};
+    size_t min_batch_ = 0;
+    size_t max_batch_ = 0;
+  };
+
+ private:
+  Class classes_[N_FREE_LIST];
+};
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_SIZE_CLASS_TUNER_H__
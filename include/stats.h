@@ -0,0 +1,67 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_STATS_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_STATS_H__
+#include "common.h"
+
+// 单个 size class 的统计
+struct HcSizeClassStats {
+  size_t size = 0;         // 对齐后的对象大小
+  size_t batch_size = 0;   // 当前的批量大小
+  size_t allocs = 0;       // 前端（thread cache / per-CPU 缓存）申请次数
+  size_t frees = 0;        // 前端释放次数
+  size_t hits = 0;         // 申请时前端自由链表非空的次数
+  size_t misses = 0;       // 申请时需要向 central cache 取的次数
+  size_t overflows = 0;    // 释放时自由链表过长、还给 central cache 的次数
+  size_t spans = 0;        // central cache 中的 span 数
+  size_t central_free_bytes = 0;   // central cache 的 span 中空闲的字节数
+  size_t transfer_bytes = 0;       // transfer cache 中缓存的字节数
+};
+
+// 锁竞争统计
+struct HcLockStats {
+  size_t acquires = 0;   // 加锁次数
+  size_t contended = 0;  // 需要等待的次数
+  size_t wait_ns = 0;    // 等待的总时间
+};
+
+// 整个内存池的统计，读取时从各层汇总
+// 前端的计数器在每个线程各自的 thread cache 中，汇总时加上已经退出的线程的计数
+struct HcStats {
+  HcSizeClassStats classes[N_FREE_LIST];
+
+  // 各层缓存的字节数
+  size_t thread_cache_bytes = 0;     // 所有 thread cache 中的空闲对象
+  size_t transfer_cache_bytes = 0;   // transfer cache 中的空闲对象
+  size_t central_cache_bytes = 0;    // central cache 的 span 中的空闲对象
+  size_t page_cache_bytes = 0;       // page cache 中的空闲页
+  size_t page_cache_returned_bytes = 0;  // 其中已经归还给操作系统的页
+  size_t system_bytes = 0;           // 向系统申请且还没有释放的字节数
+
+  size_t thread_caches = 0;          // thread cache 的个数
+  size_t central_spans = 0;          // central cache 中的 span 数
+
+  // central cache
+  size_t central_span_fetches = 0;   // 向 page cache 申请 span 的次数
+  size_t central_span_releases = 0;  // 把空闲 span 还给 page cache 的次数
+  size_t transfer_hits = 0;          // 申请命中 transfer cache 的次数
+  size_t transfer_misses = 0;        // 申请没有命中 transfer cache 的次数
+
+  // page cache
+  size_t page_new_spans = 0;         // new_span 的次数
+  size_t page_splits = 0;            // 切分 span 的次数
+  size_t page_coalesces = 0;         // 和相邻 span 合并的次数
+  size_t system_allocs = 0;          // 向系统申请内存的次数
+  size_t system_deallocs = 0;        // 把内存还给系统（munmap）的次数
+
+  // 大于 MAX_BYTES 的申请和释放
+  size_t large_allocs = 0;
+  size_t large_frees = 0;
+
+  HcLockStats central_locks;         // central cache 的桶锁
+  HcLockStats page_locks;            // page cache 的桶锁
+};
+
+// 把统计格式化到 buf 中，不申请内存；返回需要的长度（不含结尾的 '\0'），
+// 和 snprintf 一样，返回值不小于 len 说明输出被截断了
+size_t format_stats(const HcStats& stats, char* buf, size_t len);
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_STATS_H__
@@ -1,21 +1,156 @@
 #ifndef __HIGH_CONCURRENT_MEMORY_POOL_THREAD_CACHE_H__
 #define __HIGH_CONCURRENT_MEMORY_POOL_THREAD_CACHE_H__
 #include "common.h"
+#include "stats.h"
 
+// 所有 thread cache 合计最多缓存的字节数（默认值）
+const size_t DEFAULT_THREAD_CACHE_BUDGET = 32 * 1024 * 1024;
+
+// 单个 thread cache 的字节上限不低于这个值，保证一次整批申请最大的对象也放得下
+const size_t MIN_THREAD_CACHE_SIZE = 2 * MAX_BYTES;
+
+// 单个 thread cache 的字节上限最多增长到这个值
+const size_t MAX_THREAD_CACHE_SIZE = 4 * 1024 * 1024;
+
+// thread cache 每次扩大上限时从未分配的预算或其他线程那里拿走的字节数
+const size_t THREAD_CACHE_STEAL_AMOUNT = 64 * 1024;
+
+// 自由链表最多容纳的对象数
+const size_t MAX_FREE_LIST_LENGTH = 8192;
+
+// 自由链表溢出这么多次之后收缩一批容量
+const size_t MAX_FREE_LIST_OVERAGES = 3;
+
+// 所有 thread cache 的预算和占用情况
+struct ThreadCacheStats
+{
+  size_t budget_bytes = 0;     // 全局预算
+  size_t unclaimed_bytes = 0;  // 还没有分给任何线程的预算
+  size_t thread_count = 0;     // thread cache 的个数（包括 per-CPU 缓存）
+  size_t cached_bytes = 0;     // 所有 thread cache 当前缓存的字节数
+  size_t max_cached_bytes = 0; // 缓存字节数最多的一个 thread cache
+};
+
+// 每个 thread cache 有一个字节上限 max_size_，所有上限之和不超过全局预算
+// 缓存超过上限时先把一部分对象还给 central cache，再尝试扩大上限：
+// 优先使用未分配的预算，没有时轮流从其他 thread cache 那里偷一点
+// 所有 thread cache 串成双向链表，预算的分配和统计在 registry_lock_ 下进行
 class ThreadCache
 {
 public:
+  // 创建时加入全局链表并领取一份初始预算
+  ThreadCache();
+  // 析构时把缓存的对象全部归还给 central cache，预算也还回去
+  ~ThreadCache();
+  ThreadCache(const ThreadCache &) = delete;
+  ThreadCache &operator=(const ThreadCache &) = delete;
+
   void *allocate(size_t size);
 
   void deallocate(void *ptr, size_t size);
 
+  // 一次申请 n 个大小为 size 的对象放到 out 中：先取自由链表中的对象，
+  // 不够的部分按整批从 central cache 获取，直接交给调用方而不经过自由链表
+  // 申请失败时抛出 std::bad_alloc，已经取到的对象放回自由链表
+  void allocate_batch(size_t size, void **out, size_t n);
+
+  // 一次释放 n 个对象，sizes[i] 是 ptrs[i] 对齐后的大小
+  // 每 64 个对象按 size class 分组，同一个 size class 的对象不论是否相邻
+  // 都串成一段整体放进自由链表，超出容量的部分按段还给 central cache
+  void deallocate_batch(void *const *ptrs, const size_t *sizes, size_t n);
+
   // 从中心缓存获取一定数量的对象到线程缓存
   void *fetch_from_central_cache(size_t index, size_t size);
 
+  // 把所有自由链表中的对象归还给 central cache，返回归还的字节数
+  size_t flush();
+
+  // 当前缓存的字节数和字节上限
+  size_t cached_bytes() const { return size_.load(std::memory_order_relaxed); }
+  size_t max_cached_bytes() const
+  {
+    return max_size_.load(std::memory_order_relaxed);
+  }
+
+  // 设置全局预算，按线程数平分给现有的 thread cache
+  static void set_overall_budget(size_t bytes);
+
+  static ThreadCacheStats get_stats();
+
+  // 汇总所有 thread cache（包括已经销毁的）的 size class 计数和缓存字节数
+  static void collect_stats(HcStats &stats);
+
+private:
+  // index 号自由链表超过 max_size 时归还一批对象，返回归还的字节数
+  size_t release_overflow(size_t index, size_t size);
+
+  // index 号自由链表超出 max_size 的部分全部按整批还给 central cache，
+  // 每批只加一次锁，返回归还的字节数；批量申请和释放使用
+  size_t release_excess(size_t index, size_t size);
+
+  // 缓存超过上限时调用：每个自由链表归还低水位的一半，然后尝试扩大上限
+  void scavenge();
+
+  // 从未分配的预算或其他 thread cache 那里拿 THREAD_CACHE_STEAL_AMOUNT 字节
+  // 需要持有 registry_lock_
+  void increase_cache_limit_locked();
+
+  // 按当前线程数重新计算每个 thread cache 的上限，需要持有 registry_lock_
+  static void recompute_per_thread_size_locked();
+
+private:
+  // 每个 size class 的计数器，只有所属线程修改
+  struct ClassCounters
+  {
+    StatCounter allocs_;
+    StatCounter frees_;
+    StatCounter misses_;
+    StatCounter overflows_;
+  };
+
+  // 已经销毁的 thread cache 的计数器之和
+  struct RetiredCounters
+  {
+    SharedStatCounter allocs_;
+    SharedStatCounter frees_;
+    SharedStatCounter misses_;
+    SharedStatCounter overflows_;
+  };
+
 private:
   FreeList free_list_[N_FREE_LIST];
+  ClassCounters counters_[N_FREE_LIST];
+
+  // 距离下一次采样还要分配的字节数
+  size_t bytes_until_sample_ = 0;
+
+  // 只有所属线程修改 size_，其他线程只在统计时读取
+  std::atomic<size_t> size_{0};
+  // 其他线程偷预算时会修改 max_size_
+  std::atomic<size_t> max_size_{0};
+
+  ThreadCache *next_ = nullptr;
+  ThreadCache *prev_ = nullptr;
+
+  static std::mutex registry_lock_;
+  static ThreadCache *registry_head_;
+  static ThreadCache *next_victim_;
+  static size_t thread_count_;
+  static size_t overall_budget_;
+  // 可能为负：线程数很多时每个线程至少有 MIN_THREAD_CACHE_SIZE
+  static long long unclaimed_budget_;
+  static RetiredCounters retired_counters_[N_FREE_LIST];
 };
 
 ThreadCache *GetThreadCache();
 
-#endif // __HIGH_CONCURRENT_MEMORY_POOL_THREAD_CACHE_H__
\ No newline at end of file
+// 归还当前线程 thread cache 中的对象，线程还没有 thread cache 时返回 0
+size_t FlushThreadCache();
+
+// 销毁当前线程的 thread cache，下次申请时重新创建
+void DestroyThreadCache();
+
+// 当前线程的 thread cache，还没有创建时返回 nullptr
+ThreadCache *PeekThreadCache();
+
+#endif // __HIGH_CONCURRENT_MEMORY_POOL_THREAD_CACHE_H__
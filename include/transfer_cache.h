@@ -0,0 +1,41 @@
+#ifndef __HIGH_CONCURRENT_MEMORY_POOL_TRANSFER_CACHE_H__
+#define __HIGH_CONCURRENT_MEMORY_POOL_TRANSFER_CACHE_H__
+#include "common.h"
+
+// 每个 transfer cache 最多缓存 MAX_TRANSFER_BATCHES 批（按当前的批量大小计算）
+// 对象，大对象再受 MAX_TRANSFER_BYTES 字节的限制
+const size_t MAX_TRANSFER_BATCHES = 16;
+const size_t MAX_TRANSFER_BYTES = 4 * 1024 * 1024;
+
+// thread cache 和 central cache 之间的批量对象缓存，每个 size class 一个
+// 缓存的单位是 thread cache 一次移动的一批对象，存取一批只需要在自旋锁下
+// 拷贝一个数组元素，不需要查 page map 或加 central cache 的桶锁
+// 慢启动时 thread cache 每次移动的对象数小于 SizeClassTuner 给出的批量大小，
+// 所以每批记录自己的对象数；需要拆分一批时由调用方在锁外进行
+// 每个 size class 的锁是热点，独占 cache line，避免和相邻 size class 伪共享
+class alignas(kCacheLineSize) TransferCache {
+ public:
+  // 放入一批 n 个对象，批次数已满或者对象总数会超过 max_objects 时返回 false
+  // 缓存为空时总能放入一批
+  bool insert_range(void* start, void* end, size_t n, size_t max_objects);
+
+  // 取出最近放入的一整批对象，返回对象数，缓存为空时返回 0
+  size_t remove_range(void*& start, void*& end);
+
+  // 当前缓存的对象数
+  size_t cached_objects();
+
+ private:
+  struct Batch {
+    void* start_;
+    void* end_;
+    size_t n_;
+  };
+
+  SpinLock lock_;
+  size_t used_ = 0;
+  size_t cached_objects_ = 0;  // 所有批次的对象数之和
+  Batch batches_[MAX_TRANSFER_BATCHES];
+};
+
+#endif  // __HIGH_CONCURRENT_MEMORY_POOL_TRANSFER_CACHE_H__
@@ -1,47 +1,133 @@
 #include "central_cache.h"
 
 #include "page_cache.h"
+#include "size_class_tuner.h"
 
-CentralCache CentralCache::central_cache_instance_;
+Span* OccupancyLists::fullest() {
+  for (size_t i = kLevels; i-- > 0;) {
+    if (!lists_[i].empty()) {
+      return lists_[i].begin();
+    }
+  }
+  return nullptr;
+}
+
+bool OccupancyLists::empty() const {
+  if (full_spans_ != 0) {
+    return false;
+  }
+  for (size_t i = 0; i < kLevels; ++i) {
+    if (!lists_[i].empty()) {
+      return false;
+    }
+  }
+  return true;
+}
 
-CentralCache* CentralCache::GetInstance() { return &central_cache_instance_; }
+void OccupancyLists::insert(Span* span) {
+  assert(!full(span));
+  lists_[level(span->use_count_)].push_front(span);
+}
+
+void OccupancyLists::remove(Span* span, bool was_full) {
+  if (was_full) {
+    --full_spans_;
+    return;
+  }
+  // 双向链表摘除节点不需要知道所在的链表
+  lists_[0].erase(span);
+}
 
-Span* CentralCache::get_one_span(SpanList& span_list, size_t size) {
-  // TODO: Implement this function
-  // 1. 先在 list 中寻找非空 Span, 如果找到就返回
-  Span* span = span_list.begin();
-  while (span != span_list.end()) {
-    if (span->free_list_ != nullptr) {
-      return span;
+void OccupancyLists::update(Span* span, size_t old_use_count, bool was_full) {
+  if (was_full) {
+    if (!full(span)) {
+      --full_spans_;
+      insert(span);
     }
-    span = span->next_;
+    return;
   }
+  if (full(span)) {
+    lists_[0].erase(span);
+    ++full_spans_;
+    return;
+  }
+  size_t new_level = level(span->use_count_);
+  if (new_level != level(old_use_count)) {
+    lists_[0].erase(span);
+    lists_[new_level].push_front(span);
+  }
+}
 
-  // 把 central cache 的桶解锁，这样如果有其他线程释放内存，不会阻塞
-  span_list.bucket_lock_.unlock();
+#if HC_SPAN_BITMAP
+// span 中所有对象都标记为空闲，不访问对象所在的内存
+static void carve_span(Span* span, size_t size) {
+  size_t capacity = AlignMap::span_capacity(span->size_class_);
+  for (size_t w = 0; w < kSpanBitmapWords; ++w) {
+    size_t count = capacity > w * 64 ? capacity - w * 64 : 0;
+    span->free_bits_[w] =
+        count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+  }
+  span->obj_reciprocal_ =
+      static_cast<uint32_t>(((uint64_t(1) << 32) + size - 1) / size);
+}
 
-  // 2. 如果 list 中没有非空 Span, 就从 page cache 中获取一个 Span
-  PageCache::GetInstance()->page_cache_lock_.lock();
-  span =
-      PageCache::GetInstance()->new_span(AlignMap::calculate_num_pages(size));
-  span->is_used_ = true;
-  span->obj_size_ = size;
-  PageCache::GetInstance()->page_cache_lock_.unlock();
+// 按位图从低到高取出最多 n 个空闲对象串成链表，只写交给 thread cache 的对象
+static size_t take_objs(Span* span, size_t n, void*& start, void*& end) {
+  char* base = reinterpret_cast<char*>(span->page_id_ << kPageShift);
+  size_t size = span->obj_size();
+  size_t actual_num = 0;
+  void* tail = nullptr;
+  for (size_t w = 0; w < kSpanBitmapWords && actual_num < n; ++w) {
+    uint64_t bits = span->free_bits_[w];
+    while (bits != 0 && actual_num < n) {
+      size_t slot = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      void* obj = base + slot * size;
+      if (tail == nullptr) {
+        start = obj;
+      } else {
+        get_next_obj(tail) = obj;
+      }
+      tail = obj;
+      ++actual_num;
+    }
+    span->free_bits_[w] = bits;
+  }
+  assert(tail != nullptr);
+  get_next_obj(tail) = nullptr;
+  end = tail;
+  return actual_num;
+}
 
-  // 其它线程不会访问到这个 span，所以不需要加锁
-  // 最后挂入到 span_list 中需要加锁
+// 对象的偏移乘以 obj_reciprocal_ 得到序号，代替除法
+static void put_obj(Span* span, void* obj) {
+  uint64_t offset = reinterpret_cast<uintptr_t>(obj) -
+                    (span->page_id_ << kPageShift);
+  size_t slot = static_cast<size_t>((offset * span->obj_reciprocal_) >> 32);
+  assert(slot * span->obj_size() == offset);
+  assert((span->free_bits_[slot / 64] & (uint64_t(1) << (slot % 64))) == 0);
+  span->free_bits_[slot / 64] |= uint64_t(1) << (slot % 64);
+}
 
-  // 3. 把新的 Span 插入到 list 中
+// 把链表 [head, tail] 中的对象逐个放回 span
+static void put_range(Span* span, void* head, void* tail) {
+  for (void* obj = head;; obj = get_next_obj(obj)) {
+    put_obj(span, obj);
+    if (obj == tail) {
+      break;
+    }
+  }
+}
+#else
+// 把大块内存切分成小块内存放在自由链表中，尾插法
+static void carve_span(Span* span, size_t size) {
   char* start = (char*)(span->page_id_ * SYSTEM_PAGE_SIZE);
   char* end = start + span->n_pages_ * SYSTEM_PAGE_SIZE;
 
-  // 把大块内存切分成小块内存放在自由链表中，尾插法
   span->free_list_ = start;
   start += size;
   void* tail = span->free_list_;
-  int i = 1;
-  while (start < end) {
-    ++i;
+  while (start + size <= end) {
     get_next_obj(tail) = start;
     tail = start;
     start += size;
@@ -49,10 +135,74 @@ Span* CentralCache::get_one_span(SpanList& span_list, size_t size) {
 
   // 链表结束
   get_next_obj(tail) = nullptr;
+}
+
+// 从 span 中获取 n 个对象，如果不够 n 个，就尽可能多的获取
+static size_t take_objs(Span* span, size_t n, void*& start, void*& end) {
+  start = span->free_list_;
+  end = start;
+
+  size_t i = 0;
+  size_t actual_num = 1;
+  while (i < n - 1 && get_next_obj(end) != nullptr) {
+    end = get_next_obj(end);
+    ++i;
+    ++actual_num;
+  }
+  span->free_list_ = get_next_obj(end);
+  get_next_obj(end) = nullptr;
+  return actual_num;
+}
+
+// 把链表 [head, tail] 整段接到 span 的 free_list 前面
+static void put_range(Span* span, void* head, void* tail) {
+  get_next_obj(tail) = span->free_list_;
+  span->free_list_ = head;
+}
+#endif
+
+CentralCache::CentralCache() {
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    span_lists_[i].set_capacity(AlignMap::span_capacity(i));
+  }
+}
+
+CentralCache* CentralCache::GetInstance() {
+  return Instances::get(Numa::GetInstance()->current_node());
+}
+
+CentralCache* CentralCache::GetInstance(size_t node) {
+  return Instances::get(node);
+}
+
+Span* CentralCache::get_one_span(OccupancyLists& spans, size_t size) {
+  // 1. 优先从最满的 span 中分配，已满的 span 不在链表中，不需要遍历
+  Span* span = spans.fullest();
+  if (span != nullptr) {
+    return span;
+  }
+
+  // 把 central cache 的桶解锁，这样如果有其他线程释放内存，不会阻塞
+  spans.lock_.unlock();
+
+  // 2. 如果 list 中没有非空 Span, 就从 page cache 中获取一个 Span
+  // page cache 内部按桶加锁，使用本节点的 page cache
+  span = PageCache::GetInstance(node())->new_span(
+      AlignMap::calculate_num_pages(size));
+  span_fetches_.add();
+  span->size_class_ = static_cast<uint8_t>(AlignMap::hash_bucket_index(size));
+  span->is_large_ = false;
+
+  // 其它线程不会访问到这个 span，所以不需要加锁
+  // 最后挂入到 spans 中需要加锁
+
+  // 3. 把新的 Span 切分成小块内存
+  carve_span(span, size);
+  PageCache::map_size_class(span);
 
   // 切分好 span 以后，把span挂到桶里，需要加锁
-  span_list.bucket_lock_.lock();
-  span_list.push_front(span);
+  spans.lock_.lock();
+  spans.insert(span);
 
   return span;
 }
@@ -66,78 +216,254 @@ size_t CentralCache::fetch_range_objs(void*& start, void*& end, size_t size,
   //   size = AlignMap::align_upwards(size);
   size_t index = AlignMap::hash_bucket_index(size);
 
-  SpanList& span_list = span_lists_[index];
+  // 先查 transfer cache，命中就不需要加桶锁遍历 span
+  // 缓存的批次可能比 n 小（慢启动时归还的不满一批），以实际的对象数为准
+  TransferCache& transfer_cache = transfer_caches_[index];
+  size_t cached_num = transfer_cache.remove_range(start, end);
+  if (cached_num != 0) {
+    transfer_hits_.add();
+    if (cached_num > n) {
+      // 批次比需要的多，在 transfer cache 的锁外拆出前 n 个，剩下的放回去，
+      // 放不下（其他线程刚好放满）时还给 span
+      void* rest_end = end;
+      end = start;
+      for (size_t i = 1; i < n; ++i) {
+        end = get_next_obj(end);
+      }
+      void* rest = get_next_obj(end);
+      get_next_obj(end) = nullptr;
+      if (!transfer_cache.insert_range(rest, rest_end, cached_num - n,
+                                       transfer_capacity(index, size))) {
+        release_list_to_spans(rest, size);
+      }
+      cached_num = n;
+    }
+    return cached_num;
+  }
+  transfer_misses_.add();
+
+  OccupancyLists& spans = span_lists_[index];
   // 上锁
-  span_list.bucket_lock_.lock();
+  spans.lock_.lock();
 
   // 获取一个非空的span
-  Span* span = get_one_span(span_list, size);
+  Span* span = get_one_span(spans, size);
   assert(span);
-  assert(span->free_list_);
+  assert(!spans.full(span));
 
   // 从 span 中获取 n 个对象，如果不够 n 个，就尽可能多的获取
-  start = span->free_list_;
-  end = start;
-
-  size_t i = 0;
-  size_t actual_num = 1;
-  while (i < n - 1 && get_next_obj(end) != nullptr) {
-    end = get_next_obj(end);
-    ++i;
-    ++actual_num;
-  }
-  span->free_list_ = get_next_obj(end);
-  get_next_obj(end) = nullptr;
+  size_t actual_num = take_objs(span, n, start, end);
 
   // span 的小片内存分配给 thread cache，对应的 use_count_ 增加
+  // span 变得更满，可能要换到下一组，全部分配出去时从链表中摘下
+  size_t old_use_count = span->use_count_;
   span->use_count_ += actual_num;
+  spans.update(span, old_use_count, false);
 
   // 解锁
-  span_list.bucket_lock_.unlock();
+  spans.lock_.unlock();
 
   return actual_num;
 }
 
+void CentralCache::release_range_objs(void* start, void* end, size_t n,
+                                      size_t size) {
+  size_t index = AlignMap::hash_bucket_index(size);
+  // 多节点时 transfer cache 只缓存本节点的对象，否则会被本节点的线程取走
+  if ((Numa::GetInstance()->node_count() == 1 || all_local(start)) &&
+      transfer_caches_[index].insert_range(start, end, n,
+                                           transfer_capacity(index, size))) {
+    return;
+  }
+  release_list_to_spans(start, size);
+}
+
+size_t CentralCache::transfer_capacity(size_t index, size_t size) {
+  return (std::min)(
+      MAX_TRANSFER_BATCHES * SizeClassTuner::GetInstance()->batch_size(index),
+      MAX_TRANSFER_BYTES / size);
+}
+
+bool CentralCache::all_local(void* start) const {
+  for (void* current = start; current != nullptr;
+       current = get_next_obj(current)) {
+    if (PageCache::get_span_by_address(current)->node_ != node()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // 把一段内存归还给 central cache
+// 先不加锁把对象按 span 分组，每组串成一段，再加一次锁整段放回各自的 span
 void CentralCache::release_list_to_spans(void* start, size_t size) {
   size_t index = AlignMap::hash_bucket_index(size);
-  SpanList& span_list = span_lists_[index];
+  OccupancyLists& spans = span_lists_[index];
+
+  // 其他节点的对象按节点串成链表，最后转交给对应的 central cache
+  void* foreign[MAX_NUMA_NODES] = {};
+  bool has_foreign = false;
 
-  span_list.bucket_lock_.lock();
+  // 以 span 的起始页号做开放寻址，槽中存放组号 + 1，0 表示空槽
+  SpanGroup groups[kMaxReleaseGroups];
+  uint8_t slots[kReleaseSlots] = {};
+  size_t n_groups = 0;
 
+  // 一批对象大多来自同一个 span，落在上一个对象的 span 里时不用再查页表和散列表
+  Span* span = nullptr;
+  SpanGroup* group = nullptr;
   void* current = start;
   while (current) {
     void* next = get_next_obj(current);
-    Span* span = PageCache::GetInstance()->get_span_by_address(current);
+    size_t page_id = reinterpret_cast<size_t>(current) >> kPageShift;
+    if (span == nullptr || page_id - span->page_id_ >= span->n_pages_) {
+      span = PageCache::get_span_by_address(current);
+      group = nullptr;
+    }
 
-    // 把内存放回 span 的 free_list 中
-    get_next_obj(current) = span->free_list_;
-    span->free_list_ = current;
-    --span->use_count_;
+    if (span->node_ != node()) {
+      get_next_obj(current) = foreign[span->node_];
+      foreign[span->node_] = current;
+      has_foreign = true;
+      current = next;
+      continue;
+    }
 
-    // 如果 use_count_ 为 0，就把 span 归还给 page cache
+    if (group == nullptr) {
+      size_t home = static_cast<size_t>(
+          ((span->page_id_ * 0x9E3779B97F4A7C15ULL) >> 32) % kReleaseSlots);
+      size_t slot = home;
+      while (slots[slot] != 0 && groups[slots[slot] - 1].span != span) {
+        slot = (slot + 1) % kReleaseSlots;
+      }
+      if (slots[slot] == 0) {
+        // 组满了先把已经分好的归还，清空散列表后从头开始
+        if (n_groups == kMaxReleaseGroups) {
+          release_groups(spans, groups, n_groups);
+          n_groups = 0;
+          memset(slots, 0, sizeof(slots));
+          slot = home;
+        }
+        groups[n_groups] = SpanGroup{span, nullptr, nullptr, 0};
+        slots[slot] = static_cast<uint8_t>(++n_groups);
+      }
+      group = &groups[slots[slot] - 1];
+    }
+
+    get_next_obj(current) = group->head;
+    if (group->tail == nullptr) {
+      group->tail = current;
+    }
+    group->head = current;
+    ++group->count;
+
+    current = next;
+  }
+
+  if (n_groups != 0) {
+    release_groups(spans, groups, n_groups);
+  }
+
+  if (has_foreign) {
+    for (size_t i = 0; i < MAX_NUMA_NODES; ++i) {
+      if (foreign[i] != nullptr) {
+        GetInstance(i)->release_list_to_spans(foreign[i], size);
+      }
+    }
+  }
+}
+
+void CentralCache::release_groups(OccupancyLists& spans, SpanGroup* groups,
+                                  size_t n) {
+  Span* emptied[kMaxReleaseGroups];
+  size_t n_emptied = 0;
+
+  spans.lock_.lock();
+  for (size_t i = 0; i < n; ++i) {
+    Span* span = groups[i].span;
+    bool was_full = spans.full(span);
+    size_t old_use_count = span->use_count_;
+    assert(old_use_count >= groups[i].count);
+    put_range(span, groups[i].head, groups[i].tail);
+    span->use_count_ -= groups[i].count;
+
+    // 如果 use_count_ 为 0，就把 span 从 central cache 中移除，稍后归还给 page cache
     // page cache 会尝试做前后页的合并
     if (span->use_count_ == 0) {
-      // 从 central cache 中移除 span
-      span_list.erase(span);
+      spans.remove(span, was_full);
 
       span->free_list_ = nullptr;
       span->next_ = nullptr;
       span->prev_ = nullptr;
+      emptied[n_emptied++] = span;
+    } else {
+      // span 变得更空，可能要换到上一组，原来是满的就挂回链表
+      spans.update(span, old_use_count, was_full);
+    }
+  }
+  spans.lock_.unlock();
 
-      span_list.bucket_lock_.unlock();
-
-      // 把 span 归还给 page cache
-      PageCache* page_cache = PageCache::GetInstance();
-      page_cache->page_cache_lock_.lock();
-      page_cache->release_span_to_page_cache(span);
-      page_cache->page_cache_lock_.unlock();
+  // 把空出来的 span 一起归还给本节点的 page cache
+  if (n_emptied != 0) {
+    for (size_t i = 0; i < n_emptied; ++i) {
+      PageCache::unmap_size_class(emptied[i]);
+    }
+    PageCache::GetInstance(node())->release_spans(emptied, n_emptied);
+    span_releases_.add(n_emptied);
+  }
+}
 
-      span_list.bucket_lock_.lock();
+void CentralCache::drain_transfer_caches() {
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    void* start = nullptr;
+    void* end = nullptr;
+    while (transfer_caches_[i].remove_range(start, end)) {
+      release_list_to_spans(start, AlignMap::class_to_size(i));
     }
+  }
+}
 
-    current = next;
+void CentralCache::collect_stats(HcStats& stats) {
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    HcSizeClassStats& c = stats.classes[i];
+    size_t size = AlignMap::class_to_size(i);
+
+    size_t transfer_bytes = transfer_caches_[i].cached_objects() * size;
+    c.transfer_bytes += transfer_bytes;
+    stats.transfer_cache_bytes += transfer_bytes;
+
+    OccupancyLists& spans = span_lists_[i];
+    if (spans.empty()) {
+      continue;
+    }
+    std::lock_guard<BucketMutex> lock(spans.lock_);
+    // 已满的 span 没有空闲对象，只计入 span 个数
+    c.spans += spans.full_spans();
+    stats.central_spans += spans.full_spans();
+    for (size_t level = 0; level < OccupancyLists::kLevels; ++level) {
+      SpanList& span_list = spans.list(level);
+      for (Span* span = span_list.begin(); span != span_list.end();
+           span = span->next_) {
+        // span 切分出的对象数减去分配出去的对象数就是 span 中空闲的对象数
+        size_t capacity = AlignMap::span_capacity(i);
+        size_t free_bytes = (capacity - span->use_count_) * size;
+        ++c.spans;
+        c.central_free_bytes += free_bytes;
+        ++stats.central_spans;
+        stats.central_cache_bytes += free_bytes;
+      }
+    }
   }
 
-  span_list.bucket_lock_.unlock();
-}
\ No newline at end of file
+  stats.central_span_fetches += span_fetches_.get();
+  stats.central_span_releases += span_releases_.get();
+  stats.transfer_hits += transfer_hits_.get();
+  stats.transfer_misses += transfer_misses_.get();
+
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    const BucketMutex& lock = span_lists_[i].lock_;
+    stats.central_locks.acquires += lock.acquires();
+    stats.central_locks.contended += lock.contended();
+    stats.central_locks.wait_ns += lock.wait_ns();
+  }
+}
@@ -1,5 +1,16 @@
 #include "common.h"
 
+#include <cstdlib>  // std::abort
+
+#if defined(__SSE2__)
+#include <emmintrin.h>  // _mm_stream_si128, _mm_pause
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 // const size_t SYSTEM_PAGE_SIZE = []() {
 // #if defined(_WIN32)
 //   SYSTEM_INFO si;
@@ -24,6 +35,134 @@
 
 void*& get_next_obj(void* obj) { return *static_cast<void**>(obj); }
 
+void cpu_relax() {
+#if defined(__SSE2__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+void futex_wait(std::atomic<uint32_t>* word, uint32_t expected) {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE,
+          expected, nullptr, nullptr, 0);
+#else
+  (void)word;
+  (void)expected;
+  std::this_thread::yield();
+#endif
+}
+
+void futex_wake(std::atomic<uint32_t>* word) {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1,
+          nullptr, nullptr, 0);
+#else
+  (void)word;
+#endif
+}
+
+/**
+ * McsLock
+ */
+
+namespace {
+// 每个线程排队用的节点，used 的第 i 位表示 nodes[i] 正被某个锁使用
+struct McsNodes {
+  McsLock::Node nodes[McsLock::kMaxHeld];
+  unsigned used = 0;
+};
+
+thread_local McsNodes tls_mcs_nodes;
+
+McsLock::Node* acquire_mcs_node() {
+  McsNodes& t = tls_mcs_nodes;
+  for (size_t i = 0; i < McsLock::kMaxHeld; ++i) {
+    if ((t.used & (1u << i)) == 0) {
+      t.used |= 1u << i;
+      return &t.nodes[i];
+    }
+  }
+  // 同时在 kMaxHeld 个锁上排队，说明加锁的层次有问题
+  assert(false);
+  std::abort();
+}
+
+void release_mcs_node(McsLock::Node* node) {
+  McsNodes& t = tls_mcs_nodes;
+  t.used &= ~(1u << (node - t.nodes));
+}
+}  // namespace
+
+void McsLock::lock() {
+  // 没有竞争，或者刚好在锁空闲时到达，不用排队
+  if (try_lock()) {
+    return;
+  }
+
+  Node* node = acquire_mcs_node();
+  node->next_.store(nullptr, std::memory_order_relaxed);
+  node->state_.store(1, std::memory_order_relaxed);
+
+  Node* prev = tail_.exchange(node, std::memory_order_acq_rel);
+  if (prev != nullptr) {
+    prev->next_.store(node, std::memory_order_release);
+    // 前一个节点离开队首时把 state_ 置 0；自旋一会儿还没轮到就睡眠
+    int i = 0;
+    while (node->state_.load(std::memory_order_acquire) != 0) {
+      if (i < kSpinCount) {
+        ++i;
+        cpu_relax();
+        continue;
+      }
+      uint32_t expected = 1;
+      if (node->state_.compare_exchange_strong(expected, 2,
+                                               std::memory_order_acquire,
+                                               std::memory_order_acquire) ||
+          expected == 2) {
+        futex_wait(&node->state_, 2);
+      }
+    }
+  }
+
+  // 排到队首，在锁字上等待，和 SpinParkMutex 一样先自旋再睡眠
+  bool acquired = false;
+  for (int i = 0; i < kSpinCount && !acquired; ++i) {
+    acquired = locked_.load(std::memory_order_relaxed) == 0 && try_lock();
+    if (!acquired) {
+      cpu_relax();
+    }
+  }
+  if (!acquired) {
+    while (locked_.exchange(2, std::memory_order_acquire) != 0) {
+      futex_wait(&locked_, 2);
+    }
+  }
+
+  // 拿到锁，把队首交给下一个节点
+  Node* next = node->next_.load(std::memory_order_acquire);
+  if (next == nullptr) {
+    Node* expected = node;
+    if (tail_.compare_exchange_strong(expected, nullptr,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+      release_mcs_node(node);
+      return;
+    }
+    // 已经有线程排到后面，等它把自己挂到 next_ 上
+    while ((next = node->next_.load(std::memory_order_acquire)) == nullptr) {
+      std::this_thread::yield();
+    }
+  }
+  // next 的线程排到队首之后可能很快就归还节点并复用，
+  // 多出来的唤醒只会让睡在同一个节点上的线程重新检查一次 state_
+  if (next->state_.exchange(0, std::memory_order_release) == 2) {
+    futex_wake(&next->state_);
+  }
+  release_mcs_node(node);
+}
+
 /**
  * FreeList
  */
@@ -44,6 +183,9 @@ void* FreeList::pop_front() {
   free_list_ = get_next_obj(free_list_);
 
   --size_;
+  if (size_ < low_water_) {
+    low_water_ = size_;
+  }
   return obj;
 }
 
@@ -76,118 +218,24 @@ void FreeList::pop_range(void*& start, void*& end, size_t n) {
   free_list_ = get_next_obj(end);
   get_next_obj(end) = nullptr;
   size_ -= n;
-}
-
-/**
- * AlignMap:
- * 对齐映射规则的目的是为了减少内存碎片，在是实现上使用基于哈希桶的定长内存池，为了减少桶的个数，我们使用对齐策略
- */
-
-size_t AlignMap::align_upwards(size_t size, size_t align) {
-  return (size + align - 1) & ~(align - 1);
-}
-
-// 针对不同大小的内存块采用不同的对齐策略，整体控制在最多10%左右的内碎⽚浪费
-// [1, 128]                      8byte对⻬          freelist[0, 16)
-// [128 + 1, 1024]               16byte对⻬         freelist[16, 72)
-// [1024 + 1, 8 * 1024]          128byte对⻬        freelist[72, 128)
-// [8 * 1024 + 1, 64 * 1024]     1024byte对⻬       freelist[128, 184)
-// [64 * 1024 + 1, 256 * 1024]   8 * 1024byte对⻬   freelist[184, 208)
-// 上面分级对齐以后，每个区间的大小是固定的，对齐以后的种类数也是固定的
-// 因此区间中桶的数量也是固定的，可以计算出每个区间中桶的数量
-// 在[1, 128]区间中，每个桶的大小是8，桶的数量是16
-// 在[128 + 1, 1024]区间中，每个桶的大小是16，128/16=8, 1024/16=64,
-// 该区间中桶的数量是64-8=56，索引号从16开始，到16+56=72结束
-size_t AlignMap::align_upwards(size_t size) {
-  if (size <= 128) {
-    return align_upwards(size, 8);
-  } else if (size <= 1024) {
-    return align_upwards(size, 16);
-  } else if (size <= 8 * 1024) {
-    return align_upwards(size, 128);
-  } else if (size <= 64 * 1024) {
-    return align_upwards(size, 1024);
-  } else if (size <= 256 * 1024) {
-    return align_upwards(size, 8 * 1024);
-  } else {
-    // 大内存，按照系统页对齐
-    // 256KB < size <= 128*SYSTEM_PAGE_SIZE 走 page cache
-    // size > 128*SYSTEM_PAGE_SIZE 走 system alloc
-    return align_upwards(size, SYSTEM_PAGE_SIZE);
+  if (size_ < low_water_) {
+    low_water_ = size_;
   }
 }
 
-size_t AlignMap::hash_bucket_index(size_t size, size_t align_shift) {
-  return ((size + (1ULL << align_shift) - 1) >> align_shift) - 1;
-}
-
-size_t AlignMap::hash_bucket_index(size_t size) {
-  static int group_array[] = {16, 56, 56, 56};
-  if (size <= 128) {
-    return hash_bucket_index(size, 3);
-  } else if (size <= 1024) {
-    return hash_bucket_index(size - 128, 4) + group_array[0];
-  } else if (size <= 8 * 1024) {
-    return hash_bucket_index(size - 1024, 7) + group_array[0] + group_array[1];
-  } else if (size <= 64 * 1024) {
-    return hash_bucket_index(size - 8 * 1024, 10) + group_array[0] +
-           group_array[1] + group_array[2];
-  } else if (size <= 256 * 1024) {
-    return hash_bucket_index(size - 64 * 1024, 13) + group_array[0] +
-           group_array[1] + group_array[2] + group_array[3];
-  } else {
-    assert(false);
-    return -1;
-  }
-}
-
-size_t AlignMap::calculate_num_objects(size_t size) {
-  if (size == 0) {
-    return 0;
-  }
-
-  // [2, 512] 一次批量移动多少个对象的上限
-  // 小对象一次批量上限高，每次从中心缓存获取的对象数量多
-  // 大对象一次批量上限低，每次从中心缓存获取的对象数量少
-  size_t num_objects = MAX_BYTES / size;
-  if (num_objects < 2) {
-    num_objects = 2;
-  }
-  if (num_objects > 512) {
-    num_objects = 512;
-  }
-  return num_objects;
-}
-
-// 一次向系统中获取几个页
-size_t AlignMap::calculate_num_pages(size_t size) {
-  // 一次从 page cache 中获取多少页
-  // 获取对象的上限
-  size_t num_objects = calculate_num_objects(size);
-  // 总字节数
-  size_t total_bytes = num_objects * size;
-  // 总页数
-  size_t num_pages = total_bytes / SYSTEM_PAGE_SIZE;
-  if (total_bytes % SYSTEM_PAGE_SIZE != 0) {
-    num_pages++;
-  }
-  return num_pages;
-}
-
 /**
  * SpanList
  */
 
 SpanList::SpanList() {
-  head_ = new Span;
-  head_->next_ = head_;
-  head_->prev_ = head_;
+  head_.next_ = &head_;
+  head_.prev_ = &head_;
 }
 
-Span* SpanList::begin() { return head_->next_; }
-Span* SpanList::end() { return head_; }
+Span* SpanList::begin() { return head_.next_; }
+Span* SpanList::end() { return &head_; }
 
-bool SpanList::empty() const { return head_->next_ == head_; }
+bool SpanList::empty() const { return head_.next_ == &head_; }
 
 void SpanList::insert(Span* pos, Span* span) {
   assert(pos != nullptr);
@@ -201,22 +249,19 @@ void SpanList::insert(Span* pos, Span* span) {
 
 void SpanList::erase(Span* pos) {
   assert(pos != nullptr);
-  assert(pos != head_);
+  assert(pos != &head_);
 
   // 将span从链表中移除，该span会还给下一层的page cache
   pos->next_->prev_ = pos->prev_;
   pos->prev_->next_ = pos->next_;
 }
 
-void SpanList::push_front(Span* span) { insert(head_->next_, span); }
+void SpanList::push_front(Span* span) { insert(head_.next_, span); }
 
 Span* SpanList::pop_front() {
   assert(!empty());
 
-  // Span* span = head_->next_;
-  // span->next_->prev_ = head_;
-  // head_->next_ = span->next_;
-  Span* span = head_->next_;
+  Span* span = head_.next_;
   erase(span);
   return span;
 }
@@ -234,6 +279,9 @@ void* system_alloc(size_t page_count) {
   // MAP_PRIVATE | MAP_ANONYMOUS: 私有匿名映射，不与任何文件关联
   void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    ptr = nullptr;
+  }
 #endif
 
   if (ptr == nullptr) {
@@ -242,6 +290,48 @@ void* system_alloc(size_t page_count) {
   return ptr;
 }
 
+void* system_realloc(void* ptr, size_t old_pages, size_t new_pages) {
+#if defined(__linux__)
+  void* new_ptr = mremap(ptr, old_pages << kPageShift, new_pages << kPageShift,
+                         MREMAP_MAYMOVE);
+  return new_ptr == MAP_FAILED ? nullptr : new_ptr;
+#else
+  (void)ptr;
+  (void)old_pages;
+  (void)new_pages;
+  return nullptr;
+#endif
+}
+
+void* system_alloc_huge(size_t page_count) {
+#if defined(_WIN32) || !defined(MADV_HUGEPAGE)
+  (void)page_count;
+  return nullptr;
+#else
+  // 多映射一个大页的长度，再把首尾不对齐的部分还回去
+  size_t length = page_count << kPageShift;
+  size_t huge_size = 1 << kHugePageShift;
+  void* ptr = mmap(nullptr, length + huge_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+  uintptr_t aligned = (start + huge_size - 1) & ~(huge_size - 1);
+  if (aligned > start) {
+    munmap(ptr, aligned - start);
+  }
+  if (aligned + length < start + length + huge_size) {
+    munmap(reinterpret_cast<void*>(aligned + length),
+           start + length + huge_size - aligned - length);
+  }
+
+  madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE);
+  return reinterpret_cast<void*>(aligned);
+#endif
+}
+
 // 释放由 system_alloc 分配的内存
 void system_dealloc(void* ptr, size_t page_count) {
   if (ptr == nullptr) return;
@@ -258,4 +348,53 @@ void system_dealloc(void* ptr, size_t page_count) {
                              strerror(errno));
   }
 #endif
-}
\ No newline at end of file
+}
+
+// 把页归还给操作系统，但保留地址空间
+bool system_release(void* ptr, size_t page_count, bool lazy) {
+  size_t length = page_count << kPageShift;
+#ifdef _WIN32
+  // MEM_RESET: 页内容不再需要，系统可以直接丢弃，但不保证丢弃后为 0
+  (void)lazy;
+  VirtualAlloc(ptr, length, MEM_RESET, PAGE_READWRITE);
+  return false;
+#else
+#ifdef MADV_FREE
+  if (lazy) {
+    madvise(ptr, length, MADV_FREE);
+    return false;
+  }
+#endif
+  // MADV_DONTNEED: 立即释放物理页，再次访问时得到全 0 的新页
+  return madvise(ptr, length, MADV_DONTNEED) == 0;
+#endif
+}
+
+void zero_memory(void* ptr, size_t size) {
+#if defined(__SSE2__)
+  // 小块内存很可能马上被使用，留在 cache 中更好
+  const size_t kNonTemporalThreshold = 64 * 1024;
+  if (size >= kNonTemporalThreshold) {
+    char* start = static_cast<char*>(ptr);
+    char* end = start + size;
+    // 首尾不满 64 字节的部分用 memset，中间按 cache line 写入
+    char* first = reinterpret_cast<char*>(
+        AlignMap::align_upwards(reinterpret_cast<uintptr_t>(start), 64));
+    char* last = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(end) &
+                                         ~static_cast<uintptr_t>(63));
+    memset(start, 0, first - start);
+    const __m128i zero = _mm_setzero_si128();
+    for (char* p = first; p < last; p += 64) {
+      _mm_stream_si128(reinterpret_cast<__m128i*>(p), zero);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(p + 16), zero);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(p + 32), zero);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(p + 48), zero);
+    }
+    // non-temporal 写入是弱序的，之后的普通写入和其他线程要能看到清零的结果
+    _mm_sfence();
+    memset(last, 0, end - last);
+    return;
+  }
+#endif
+  memset(ptr, 0, size);
+}
@@ -0,0 +1,91 @@
+#include "cpu_cache.h"
+
+#include <new>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HC_HAVE_RSEQ 1
+#endif
+#endif
+
+CpuCache CpuCache::cpu_cache_instance_;
+
+CpuCache* CpuCache::GetInstance() { return &cpu_cache_instance_; }
+
+int CpuCache::current_cpu() {
+#ifdef HC_HAVE_RSEQ
+  // glibc 2.35 起每个线程创建时都会向内核注册 rseq，__rseq_size 为 0 说明没有注册
+  // 内核在线程每次被调度回来时更新 cpu_id，读取它只是一次普通的内存访问
+  if (__rseq_size == 0) {
+    return -1;
+  }
+  const volatile struct rseq* rs =
+      reinterpret_cast<const volatile struct rseq*>(
+          static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+  return static_cast<int>(rs->cpu_id);
+#else
+  return -1;
+#endif
+}
+
+bool CpuCache::set_enabled(bool enable) {
+  enabled_.store(enable && current_cpu() >= 0, std::memory_order_relaxed);
+  return enabled();
+}
+
+CpuCache::Slot* CpuCache::get_slot(int cpu) {
+  if (cpu < 0 || static_cast<size_t>(cpu) >= MAX_CPUS) {
+    return nullptr;
+  }
+
+  Slot* slot = slots_[cpu].load(std::memory_order_acquire);
+  if (slot == nullptr) {
+    // 槽直接向系统申请，多个线程同时初始化时只保留一个
+    size_t page_count =
+        AlignMap::align_upwards(sizeof(Slot), SYSTEM_PAGE_SIZE) >> kPageShift;
+    Slot* fresh = new (system_alloc(page_count)) Slot;
+    if (slots_[cpu].compare_exchange_strong(slot, fresh,
+                                            std::memory_order_acq_rel)) {
+      slot = fresh;
+    } else {
+      fresh->~Slot();
+      system_dealloc(fresh, page_count);
+    }
+  }
+  return slot;
+}
+
+void* CpuCache::allocate(size_t size) {
+  Slot* slot = get_slot(current_cpu());
+  if (slot == nullptr) {
+    return GetThreadCache()->allocate(size);
+  }
+
+  if (slot->lock_.try_lock()) {
+    void* ptr = slot->cache_.allocate(size);
+    slot->lock_.unlock();
+    return ptr;
+  }
+
+  // 持有该槽的线程在临界区内被抢占了，不等待，从自己的 thread cache 中申请，
+  // 不必每个对象都去加 central cache 的桶锁
+  return GetThreadCache()->allocate(size);
+}
+
+void CpuCache::deallocate(void* ptr, size_t size) {
+  Slot* slot = get_slot(current_cpu());
+  if (slot == nullptr) {
+    GetThreadCache()->deallocate(ptr, size);
+    return;
+  }
+
+  if (slot->lock_.try_lock()) {
+    slot->cache_.deallocate(ptr, size);
+    slot->lock_.unlock();
+    return;
+  }
+
+  // 同上，槽被占用时放进自己的 thread cache
+  GetThreadCache()->deallocate(ptr, size);
+}
@@ -0,0 +1,256 @@
+#include "heap_profiler.h"
+
+#include <cmath>
+#include <cstdio>
+#include <new>
+
+#include "page_cache.h"
+
+#if defined(__linux__)
+#include <execinfo.h>
+#include <fcntl.h>
+#endif
+
+HeapProfiler HeapProfiler::heap_profiler_instance_;
+
+HeapProfiler* HeapProfiler::GetInstance() { return &heap_profiler_instance_; }
+
+// 当前线程是否正在采样，获取调用栈时可能会再次申请内存，这时不再采样
+static thread_local bool tls_in_sampling = false;
+
+// 每个线程自己的随机数状态，不需要加锁
+static thread_local uint64_t tls_random_state = 0;
+
+size_t HeapProfiler::next_sample_interval() {
+  size_t rate = sample_rate();
+  if (rate == 0) {
+    return SAMPLE_RECHECK_BYTES;
+  }
+
+  // xorshift64*，用状态变量的地址作为每个线程不同的种子
+  if (tls_random_state == 0) {
+    tls_random_state =
+        reinterpret_cast<uint64_t>(&tls_random_state) ^ 0x9E3779B97F4A7C15ULL;
+  }
+  tls_random_state ^= tls_random_state >> 12;
+  tls_random_state ^= tls_random_state << 25;
+  tls_random_state ^= tls_random_state >> 27;
+  uint64_t r = tls_random_state * 2685821657736338717ULL;
+
+  // u 在 (0, 1] 上均匀分布，-ln(u) * rate 服从均值为 rate 的指数分布
+  double u = static_cast<double>((r >> 11) + 1) / 9007199254740992.0;
+  double interval = -std::log(u) * static_cast<double>(rate);
+  return static_cast<size_t>(interval) + 1;
+}
+
+size_t HeapProfiler::capture_stack(void** stack, size_t skip) {
+#if defined(__linux__)
+  void* frames[MAX_STACK_DEPTH + 4];
+  int depth = backtrace(frames, static_cast<int>(MAX_STACK_DEPTH + skip));
+  if (depth <= static_cast<int>(skip)) {
+    return 0;
+  }
+  size_t n = (std::min)(static_cast<size_t>(depth) - skip, MAX_STACK_DEPTH);
+  memcpy(stack, frames + skip, n * sizeof(void*));
+  return n;
+#else
+  (void)stack;
+  (void)skip;
+  return 0;
+#endif
+}
+
+void* HeapProfiler::allocate_sampled(size_t size) {
+  if (tls_in_sampling) {
+    return nullptr;
+  }
+  tls_in_sampling = true;
+
+  // 跳过 capture_stack 和 allocate_sampled 两帧
+  void* stack[MAX_STACK_DEPTH];
+  size_t depth = capture_stack(stack, 2);
+
+  // 按页申请，被采样的对象独占一个 span
+  size_t aligned_size = AlignMap::align_upwards(size);
+  size_t num_pages =
+      AlignMap::align_upwards(aligned_size, SYSTEM_PAGE_SIZE) >> kPageShift;
+  Span* span = PageCache::GetInstance()->new_span(num_pages);
+  span->size_class_ = static_cast<uint8_t>(AlignMap::hash_bucket_index(size));
+  span->is_large_ = false;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    span->sample_bucket_ = record_locked(stack, depth, aligned_size);
+  }
+
+  tls_in_sampling = false;
+  return reinterpret_cast<void*>(span->page_id_ << kPageShift);
+}
+
+void HeapProfiler::maybe_sample_large(Span* span, size_t size) {
+  long long left =
+      large_bytes_until_sample_.fetch_sub(size, std::memory_order_relaxed) -
+      static_cast<long long>(size);
+  if (left >= 0 || tls_in_sampling) {
+    return;
+  }
+
+  // 多个线程同时到期时可能都会采样，只影响采样的精度
+  large_bytes_until_sample_.store(next_sample_interval(),
+                                  std::memory_order_relaxed);
+  if (sample_rate() == 0) {
+    return;
+  }
+
+  tls_in_sampling = true;
+  void* stack[MAX_STACK_DEPTH];
+  size_t depth = capture_stack(stack, 2);
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    span->sample_bucket_ = record_locked(stack, depth, span->obj_size());
+  }
+  tls_in_sampling = false;
+}
+
+void HeapProfiler::release_sampled(Span* span) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    SampleBucket* bucket = span->sample_bucket_;
+    ++bucket->free_count_;
+    bucket->free_bytes_ += span->obj_size();
+  }
+  span->sample_bucket_ = nullptr;
+  PageCache::GetInstance(span->node_)->release_span_to_page_cache(span);
+}
+
+SampleBucket* HeapProfiler::record_locked(void** stack, size_t depth,
+                                          size_t bytes) {
+  size_t hash = depth;
+  for (size_t i = 0; i < depth; ++i) {
+    hash += reinterpret_cast<size_t>(stack[i]);
+    hash += hash << 10;
+    hash ^= hash >> 6;
+  }
+
+  // 哈希表和桶第一次采样时才向系统申请，不经过内存池本身
+  if (table_ == nullptr) {
+    table_ = static_cast<SampleBucket**>(system_alloc(
+        AlignMap::align_upwards(MAX_SAMPLE_BUCKETS * sizeof(SampleBucket*),
+                                SYSTEM_PAGE_SIZE) >>
+        kPageShift));
+    buckets_ = static_cast<SampleBucket*>(system_alloc(
+        AlignMap::align_upwards(MAX_SAMPLE_BUCKETS * sizeof(SampleBucket),
+                                SYSTEM_PAGE_SIZE) >>
+        kPageShift));
+  }
+
+  size_t slot = hash % MAX_SAMPLE_BUCKETS;
+  SampleBucket* bucket = table_[slot];
+  while (bucket != nullptr &&
+         (bucket->hash_ != hash || bucket->depth_ != depth ||
+          memcmp(bucket->stack_, stack, depth * sizeof(void*)) != 0)) {
+    bucket = bucket->next_;
+  }
+
+  if (bucket == nullptr) {
+    if (used_buckets_ < MAX_SAMPLE_BUCKETS) {
+      bucket = new (&buckets_[used_buckets_++]) SampleBucket;
+      bucket->hash_ = hash;
+      bucket->depth_ = depth;
+      memcpy(bucket->stack_, stack, depth * sizeof(void*));
+      bucket->next_ = table_[slot];
+      table_[slot] = bucket;
+    } else {
+      bucket = &overflow_bucket_;
+    }
+  }
+
+  ++bucket->alloc_count_;
+  bucket->alloc_bytes_ += bytes;
+  return bucket;
+}
+
+#if defined(__linux__)
+// 把 buf 全部写入 fd
+static bool write_all(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 一个桶一行：存活的次数和字节数 [累计的次数和字节数] @ 调用栈
+static bool write_bucket(int fd, const SampleBucket& bucket) {
+  char line[64 + MAX_STACK_DEPTH * 20];
+  int len = snprintf(line, sizeof(line), "%6zu: %8zu [%6zu: %8zu] @",
+                     bucket.alloc_count_ - bucket.free_count_,
+                     bucket.alloc_bytes_ - bucket.free_bytes_,
+                     bucket.alloc_count_, bucket.alloc_bytes_);
+  for (size_t i = 0; i < bucket.depth_; ++i) {
+    len += snprintf(line + len, sizeof(line) - len, " 0x%zx",
+                    reinterpret_cast<size_t>(bucket.stack_[i]));
+  }
+  len += snprintf(line + len, sizeof(line) - len, "\n");
+  return write_all(fd, line, len);
+}
+
+bool HeapProfiler::dump(int fd) {
+  std::lock_guard<std::mutex> lock(lock_);
+
+  SampleBucket total;
+  for (size_t i = 0; i <= used_buckets_; ++i) {
+    const SampleBucket& bucket =
+        i < used_buckets_ ? buckets_[i] : overflow_bucket_;
+    total.alloc_count_ += bucket.alloc_count_;
+    total.alloc_bytes_ += bucket.alloc_bytes_;
+    total.free_count_ += bucket.free_count_;
+    total.free_bytes_ += bucket.free_bytes_;
+  }
+
+  // pprof 根据 heap_v2/<采样间隔> 把样本还原成估计的真实值
+  char header[128];
+  int len = snprintf(header, sizeof(header),
+                     "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                     total.alloc_count_ - total.free_count_,
+                     total.alloc_bytes_ - total.free_bytes_,
+                     total.alloc_count_, total.alloc_bytes_,
+                     (std::max)(sample_rate(), static_cast<size_t>(1)));
+  if (!write_all(fd, header, len)) {
+    return false;
+  }
+  for (size_t i = 0; i <= used_buckets_; ++i) {
+    const SampleBucket& bucket =
+        i < used_buckets_ ? buckets_[i] : overflow_bucket_;
+    if (bucket.alloc_count_ != 0 && !write_bucket(fd, bucket)) {
+      return false;
+    }
+  }
+
+  // pprof 需要进程的内存映射来把地址对应到共享库和符号
+  const char kMapsHeader[] = "\nMAPPED_LIBRARIES:\n";
+  if (!write_all(fd, kMapsHeader, sizeof(kMapsHeader) - 1)) {
+    return false;
+  }
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps < 0) {
+    return true;
+  }
+  char buf[4096];
+  ssize_t n = 0;
+  bool ok = true;
+  while (ok && (n = read(maps, buf, sizeof(buf))) > 0) {
+    ok = write_all(fd, buf, n);
+  }
+  close(maps);
+  return ok;
+}
+#else
+bool HeapProfiler::dump(int fd) {
+  (void)fd;
+  return false;
+}
+#endif
@@ -1,36 +1,380 @@
 #include "high_concurrent_memory_pool.h"
 
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+// 大内存的申请和释放次数
+static SharedStatCounter large_allocs;
+static SharedStatCounter large_frees;
+
+// 大内存申请，走 page cache，返回整个 span
+static Span* allocate_large(size_t size) {
+  size_t aligned_size = AlignMap::align_upwards(size);  // 按页面对齐
+  size_t num_pages = aligned_size >> kPageShift;        // 占用的页数
+
+  // 从当前节点的 page cache 中获取一定数量的页，page cache 内部按桶加锁
+  // 标记为大内存，释放时据此判断走 page cache，对象大小就是整个 span
+  Span* span = PageCache::GetInstance()->new_span(num_pages);
+  span->is_large_ = true;
+  large_allocs.add();
+  HeapProfiler::GetInstance()->maybe_sample_large(span, aligned_size);
+  return span;
+}
+
 void* hc_malloc(size_t size) {
   if (size > MAX_BYTES) {
-    // 大内存申请，走 page cache
-    size_t aligned_size = AlignMap::align_upwards(size);  // 按页面对齐
-    size_t num_pages = aligned_size >> kPageShift;        // 占用的页数
-
-    // 从 page cache 中获取一定数量的页，需要上锁
-    PageCache* page_cache = PageCache::GetInstance();
-    page_cache->page_cache_lock_.lock();
-    Span* span = page_cache->new_span(num_pages);
-    page_cache->page_cache_lock_.unlock();
-    void* ptr = reinterpret_cast<void*>(span->page_id_ << kPageShift);
-    return ptr;
+    Span* span = allocate_large(size);
+    return reinterpret_cast<void*>(span->page_id_ << kPageShift);
   } else {
+    // 开启了 per-CPU 缓存时优先使用当前 CPU 的缓存
+    CpuCache* cpu_cache = CpuCache::GetInstance();
+    if (cpu_cache->enabled()) {
+      return cpu_cache->allocate(size);
+    }
     return GetThreadCache()->allocate(size);
   }
 }
 
+void* hc_calloc(size_t num, size_t size) {
+  if (size != 0 && num > SIZE_MAX / size) {
+    throw std::bad_alloc();
+  }
+  size_t total = num * size;
+
+  if (total <= MAX_BYTES) {
+    // 小对象所在的 span 被切分过，对象可能被用过，只清零申请的部分
+    void* ptr = hc_malloc(total);
+    memset(ptr, 0, total);
+    return ptr;
+  }
+
+  // 大内存的页刚从系统映射或者刚用 MADV_DONTNEED 归还过时已经全为 0，
+  // 不需要再写一遍，否则用 non-temporal 写入清零
+  Span* span = allocate_large(total);
+  void* ptr = reinterpret_cast<void*>(span->page_id_ << kPageShift);
+  if (!span->zeroed_) {
+    zero_memory(ptr, total);
+  }
+  return ptr;
+}
+
+// 小内存释放，走 thread cache 或 per-CPU 缓存，size 是对齐后的大小
+static inline void free_small(void* ptr, size_t size) {
+  CpuCache* cpu_cache = CpuCache::GetInstance();
+  if (cpu_cache->enabled()) {
+    cpu_cache->deallocate(ptr, size);
+    return;
+  }
+  GetThreadCache()->deallocate(ptr, size);
+}
+
 void hc_free(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  // 小对象直接从页表查到 size class，不需要访问 span
+  size_t index;
+  if (PageCache::get_size_class(ptr, index)) {
+    free_small(ptr, AlignMap::class_to_size(index));
+    return;
+  }
+
   // 根据地址获取对应的 span
-  PageCache* page_cache = PageCache::GetInstance();
-  Span* span = page_cache->get_span_by_address(ptr);
-  size_t size = span->obj_size_;
+  Span* span = PageCache::get_span_by_address(ptr);
 
-  if (size > MAX_BYTES) {
-    // 大内存释放，走 page cache
-    page_cache->page_cache_lock_.lock();
-    page_cache->release_span_to_page_cache(span);
-    page_cache->page_cache_lock_.unlock();
-  } else {
-    // 小内存释放，走 thread cache
-    GetThreadCache()->deallocate(ptr, size);
+  // 被采样的对象独占一个 span，更新 heap profile 后整个 span 还给 page cache
+  if (span->sample_bucket_ != nullptr) {
+    if (span->is_large_) {
+      large_frees.add();
+    }
+    HeapProfiler::GetInstance()->release_sampled(span);
+    return;
+  }
+
+  // 大内存释放，还给 span 所属节点的 page cache
+  assert(span->is_large_);
+  PageCache::GetInstance(span->node_)->release_span_to_page_cache(span);
+  large_frees.add();
+}
+
+void hc_malloc_batch(size_t size, size_t n, void** out) {
+  if (size > MAX_BYTES || CpuCache::GetInstance()->enabled()) {
+    // 大内存每个对象都要单独的 span；per-CPU 缓存不支持批量操作
+    size_t i = 0;
+    try {
+      for (; i < n; ++i) {
+        out[i] = hc_malloc(size);
+      }
+    } catch (...) {
+      hc_free_batch(out, i);
+      throw;
+    }
+    return;
+  }
+  GetThreadCache()->allocate_batch(size, out, n);
+}
+
+void hc_free_batch(void** ptrs, size_t n) {
+  if (CpuCache::GetInstance()->enabled()) {
+    for (size_t i = 0; i < n; ++i) {
+      hc_free(ptrs[i]);
+    }
+    return;
+  }
+
+  // 分段从页表查出每个对象的 size class，小对象整段交给 thread cache，
+  // 大内存和被采样的对象没有记录 size class，逐个走 hc_free
+  const size_t kChunk = 64;
+  void* objs[kChunk];
+  size_t sizes[kChunk];
+  size_t count = 0;
+  ThreadCache* cache = GetThreadCache();
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    if (ptr == nullptr) {
+      continue;
+    }
+    size_t index;
+    if (!PageCache::get_size_class(ptr, index)) {
+      hc_free(ptr);
+      continue;
+    }
+    objs[count] = ptr;
+    sizes[count] = AlignMap::class_to_size(index);
+    if (++count == kChunk) {
+      cache->deallocate_batch(objs, sizes, count);
+      count = 0;
+    }
+  }
+  if (count > 0) {
+    cache->deallocate_batch(objs, sizes, count);
+  }
+}
+
+void hc_free_sized(void* ptr, size_t size) {
+  // 大内存需要 span 本身；被采样的对象和对齐超过一页的对象单独占用一个 span，
+  // 地址一定按页对齐，所以页对齐的地址（包括 nullptr）都走 hc_free 查 span，
+  // 其余的不访问页表和 span
+  if (size > MAX_BYTES ||
+      (reinterpret_cast<uintptr_t>(ptr) & (SYSTEM_PAGE_SIZE - 1)) == 0) {
+    hc_free(ptr);
+    return;
+  }
+
+  size = AlignMap::align_upwards(size);
+#if HC_CHECK_SIZED_FREE
+  size_t index;
+  bool small = PageCache::get_size_class(ptr, index);
+  if (!small || AlignMap::class_to_size(index) != size) {
+    fprintf(stderr,
+            "hc_free_sized: size mismatch for %p: freed as %zu, "
+            "allocated as %zu\n",
+            ptr, size, small ? AlignMap::class_to_size(index) : 0);
+    abort();
   }
-}
\ No newline at end of file
+#endif
+  free_small(ptr, size);
+}
+
+void* hc_aligned_alloc(size_t alignment, size_t size) {
+  assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+  if (alignment <= SYSTEM_PAGE_SIZE) {
+    // 直接选一个对象天然对齐的 size class，不多申请也不需要调整指针，
+    // 释放时和普通对象一样按 span 中记录的大小回到对应的桶；
+    // 大于 MAX_BYTES 的申请本身就按页对齐
+    size_t index = AlignMap::aligned_bucket_index(size, alignment);
+    return hc_malloc(index < N_FREE_LIST ? AlignMap::class_to_size(index)
+                                         : size);
+  }
+
+  // 对齐超过一页时单独占用一个起始地址对齐的 span，只占用 size 所需的页，
+  // 按大内存处理：hc_free 根据 is_large_ 把整个 span 还给 page cache
+  size_t aligned_size =
+      AlignMap::align_upwards(size == 0 ? 1 : size, SYSTEM_PAGE_SIZE);
+  Span* span = PageCache::GetInstance()->new_aligned_span(
+      aligned_size >> kPageShift, alignment >> kPageShift);
+  span->is_large_ = true;
+  large_allocs.add();
+  HeapProfiler::GetInstance()->maybe_sample_large(span, aligned_size);
+  return reinterpret_cast<void*>(span->page_id_ << kPageShift);
+}
+
+void* hc_memalign(size_t alignment, size_t size) {
+  return hc_aligned_alloc(alignment, size);
+}
+
+void* hc_realloc(void* ptr, size_t size) {
+  if (ptr == nullptr) {
+    return hc_malloc(size);
+  }
+  if (size == 0) {
+    hc_free(ptr);
+    return nullptr;
+  }
+
+  Span* span = PageCache::get_span_by_address(ptr);
+  size_t old_size = span->obj_size();
+
+  // 被采样的对象要在 heap profile 中记录新的大小，总是重新申请
+  if (span->sample_bucket_ == nullptr) {
+    if (!span->is_large_) {
+      // 仍然属于同一个 size class
+      if (size <= MAX_BYTES && AlignMap::align_upwards(size) == old_size) {
+        return ptr;
+      }
+    } else if (size > MAX_BYTES) {
+      // 大内存按页调整：缩小时把尾部还回去，增大时吞并后面的空闲页，
+      // 超过 128 页时重新映射，都不需要复制数据
+      size_t aligned_size = AlignMap::align_upwards(size, SYSTEM_PAGE_SIZE);
+      if (PageCache::GetInstance(span->node_)
+              ->resize_span(span, aligned_size >> kPageShift)) {
+        return reinterpret_cast<void*>(span->page_id_ << kPageShift);
+      }
+    }
+  }
+
+  // 申请失败时抛出 std::bad_alloc，原来的内存保持不变
+  void* new_ptr = hc_malloc(size);
+  memcpy(new_ptr, ptr, (std::min)(old_size, size));
+  hc_free(ptr);
+  return new_ptr;
+}
+
+size_t hc_malloc_usable_size(void* ptr) {
+  if (ptr == nullptr) {
+    return 0;
+  }
+  // 小对象是 size class 的大小，大内存是整个 span 的大小，指针都在对象的起始位置
+  size_t index;
+  if (PageCache::get_size_class(ptr, index)) {
+    return AlignMap::class_to_size(index);
+  }
+  return PageCache::get_span_by_address(ptr)->obj_size();
+}
+
+bool hc_set_per_cpu_cache(bool enable) {
+  return CpuCache::GetInstance()->set_enabled(enable);
+}
+
+void hc_scavenger_start(size_t interval_ms, size_t decay_ms) {
+  Scavenger::GetInstance()->start(interval_ms, decay_ms);
+}
+
+void hc_scavenger_stop() { Scavenger::GetInstance()->stop(); }
+
+void hc_set_lazy_scavenge(size_t interval_ms, size_t decay_ms) {
+  Scavenger::GetInstance()->set_lazy(interval_ms, decay_ms);
+}
+
+void hc_set_scavenge_madv_free(bool enable) {
+  Scavenger::GetInstance()->set_madv_free(enable);
+}
+
+bool hc_set_hugepage_mode(bool enable) {
+  bool enabled = false;
+  for (size_t node = 0; node < MAX_NUMA_NODES; ++node) {
+    enabled = PageCache::GetInstance(node)->set_hugepage_mode(enable);
+  }
+  return enabled;
+}
+
+void hc_get_hugepage_stats(size_t* reserved_bytes, size_t* released_bytes) {
+  size_t reserved = 0;
+  size_t released = 0;
+  for (size_t node = 0; node < MAX_NUMA_NODES; ++node) {
+    PageCache* page_cache = PageCache::GetInstance(node);
+    reserved += page_cache->hugepage_reserved_bytes();
+    released += page_cache->hugepage_released_bytes();
+  }
+  if (reserved_bytes != nullptr) {
+    *reserved_bytes = reserved;
+  }
+  if (released_bytes != nullptr) {
+    *released_bytes = released;
+  }
+}
+
+bool hc_set_numa_aware(bool enable, size_t simulated_nodes) {
+  return Numa::GetInstance()->set_enabled(enable, simulated_nodes);
+}
+
+size_t hc_numa_node_count() { return Numa::GetInstance()->node_count(); }
+
+size_t hc_thread_cache_flush() { return FlushThreadCache(); }
+
+void hc_thread_idle() { DestroyThreadCache(); }
+
+void hc_set_thread_cache_budget(size_t bytes) {
+  ThreadCache::set_overall_budget(bytes);
+}
+
+ThreadCacheStats hc_get_thread_cache_stats() { return ThreadCache::get_stats(); }
+
+void hc_get_thread_cache_usage(size_t* cached_bytes, size_t* limit_bytes) {
+  ThreadCache* cache = PeekThreadCache();
+  if (cached_bytes != nullptr) {
+    *cached_bytes = cache != nullptr ? cache->cached_bytes() : 0;
+  }
+  if (limit_bytes != nullptr) {
+    *limit_bytes = cache != nullptr ? cache->max_cached_bytes() : 0;
+  }
+}
+
+void hc_get_stats(HcStats* stats) {
+  *stats = HcStats();
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    stats->classes[i].size = AlignMap::class_to_size(i);
+    stats->classes[i].batch_size = SizeClassTuner::GetInstance()->batch_size(i);
+  }
+  ThreadCache::collect_stats(*stats);
+  for (size_t node = 0; node < MAX_NUMA_NODES; ++node) {
+    CentralCache::GetInstance(node)->collect_stats(*stats);
+    PageCache::GetInstance(node)->collect_stats(*stats);
+  }
+  stats->large_allocs = large_allocs.get();
+  stats->large_frees = large_frees.get();
+}
+
+size_t hc_format_stats(char* buf, size_t len) {
+  // HcStats 有十几 KB，放在静态区，避免占用调用线程的栈；多个线程同时调用时加锁
+  static std::mutex stats_lock;
+  static HcStats stats;
+  std::lock_guard<std::mutex> lock(stats_lock);
+  hc_get_stats(&stats);
+  return format_stats(stats, buf, len);
+}
+
+void hc_set_sample_rate(size_t bytes) {
+  HeapProfiler::GetInstance()->set_sample_rate(bytes);
+}
+
+size_t hc_get_sample_rate() { return HeapProfiler::GetInstance()->sample_rate(); }
+
+bool hc_dump_heap_profile(const char* path) {
+#if defined(__linux__)
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = HeapProfiler::GetInstance()->dump(fd);
+  return close(fd) == 0 && ok;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+size_t hc_trim() {
+  // 先把调用线程和 transfer cache 中的对象还给 span，这样空出来的 span 才能回到 page cache
+  FlushThreadCache();
+  for (size_t node = 0; node < MAX_NUMA_NODES; ++node) {
+    CentralCache::GetInstance(node)->drain_transfer_caches();
+  }
+  return Scavenger::GetInstance()->scavenge(0);
+}
@@ -0,0 +1,96 @@
+#include "numa.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+Numa Numa::numa_instance_;
+
+Numa* Numa::GetInstance() { return &numa_instance_; }
+
+size_t Numa::detect_node_count() {
+#if defined(__linux__)
+  // 文件内容形如 "0" 或 "0-1"，取最大的节点号加一
+  // 这里不能使用 fopen/ifstream，它们会申请内存
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1;
+  }
+  char buf[64] = {0};
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 1;
+  }
+
+  size_t max_node = 0;
+  size_t value = 0;
+  for (ssize_t i = 0; i < len; ++i) {
+    if (buf[i] >= '0' && buf[i] <= '9') {
+      value = value * 10 + (buf[i] - '0');
+      max_node = (std::max)(max_node, value);
+    } else {
+      value = 0;
+    }
+  }
+  return (std::min)(max_node + 1, MAX_NUMA_NODES);
+#else
+  return 1;
+#endif
+}
+
+bool Numa::set_enabled(bool enable, size_t simulated_nodes) {
+  size_t nodes = 1;
+  if (enable) {
+    nodes = simulated_nodes != 0 ? (std::min)(simulated_nodes, MAX_NUMA_NODES)
+                                 : detect_node_count();
+  }
+  simulated_.store(enable && simulated_nodes != 0, std::memory_order_relaxed);
+  node_count_.store(nodes, std::memory_order_relaxed);
+  enabled_.store(enable, std::memory_order_relaxed);
+  return enable;
+}
+
+size_t Numa::current_node() const {
+  if (!enabled()) {
+    return 0;
+  }
+
+  size_t nodes = node_count();
+  if (simulated_.load(std::memory_order_relaxed)) {
+    // 模拟模式下每个线程第一次访问时轮流分配一个节点
+    static std::atomic<size_t> next_node{0};
+    thread_local size_t node = next_node.fetch_add(1);
+    return node % nodes;
+  }
+
+#if defined(__linux__)
+  // getcpu 走 vDSO，不需要陷入内核
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+  if (getcpu(&cpu, &node) == 0 && node < nodes) {
+    return node;
+  }
+#endif
+  return 0;
+}
+
+void Numa::bind(void* ptr, size_t page_count, size_t node) const {
+#if defined(__linux__) && defined(SYS_mbind)
+  if (!enabled() || simulated_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  // 使用 MPOL_PREFERRED：节点内存不足时退回到其他节点，而不是直接失败
+  unsigned long node_mask = 1UL << node;
+  syscall(SYS_mbind, ptr, page_count << kPageShift, MPOL_PREFERRED,
+          &node_mask, MAX_NUMA_NODES + 1, 0);
+#else
+  (void)ptr;
+  (void)page_count;
+  (void)node;
+#endif
+}
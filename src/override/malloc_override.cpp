@@ -0,0 +1,234 @@
+// 替换全局的 malloc/free 和 operator new/delete，编译进 libhcmalloc.so，
+// 通过 LD_PRELOAD 让现有程序不改代码就使用内存池：
+//   LD_PRELOAD=/path/to/libhcmalloc.so ./program
+// 内存池内部不能调用这里的任何函数（包括 new/std::vector），否则会递归
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "high_concurrent_memory_pool.h"
+
+// x86-64 等平台的 ABI 要求 malloc 返回的内存按 16 字节对齐（max_align_t），
+// 而 [1, 128] 的 size class 按 8 字节对齐，大于 8 字节的申请取整到 16 的倍数
+static const size_t kMallocAlignment = alignof(std::max_align_t);
+
+static inline size_t malloc_size(size_t size) {
+  if (size <= 8) {
+    // malloc(0) 也返回一个可以 free 的唯一指针
+    return size == 0 ? 1 : size;
+  }
+  return AlignMap::align_upwards(size, kMallocAlignment);
+}
+
+// 内存不足时 hc_malloc 抛出 std::bad_alloc，C 接口改为设置 errno 并返回 nullptr
+static inline void* do_malloc(size_t size) noexcept {
+  try {
+    return hc_malloc(malloc_size(size));
+  } catch (...) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+}
+
+static inline void* do_memalign(size_t alignment, size_t size) noexcept {
+  if (alignment <= kMallocAlignment) {
+    return do_malloc(size);
+  }
+  try {
+    return hc_aligned_alloc(alignment, size == 0 ? 1 : size);
+  } catch (...) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+}
+
+static inline void* do_realloc(void* ptr, size_t size) noexcept {
+  if (ptr == nullptr) {
+    return do_malloc(size);
+  }
+  if (size == 0) {
+    hc_free(ptr);
+    return nullptr;
+  }
+  try {
+    return hc_realloc(ptr, malloc_size(size));
+  } catch (...) {
+    // 失败时原来的内存保持不变
+    errno = ENOMEM;
+    return nullptr;
+  }
+}
+
+static inline bool is_power_of_two(size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+// operator new 失败时先调用 new_handler，没有设置 new_handler 时抛出 bad_alloc
+static void* do_new(size_t size, size_t alignment) {
+  for (;;) {
+    try {
+      return alignment <= kMallocAlignment
+                 ? hc_malloc(malloc_size(size))
+                 : hc_aligned_alloc(alignment, size == 0 ? 1 : size);
+    } catch (const std::bad_alloc&) {
+      std::new_handler handler = std::get_new_handler();
+      if (handler == nullptr) {
+        throw;
+      }
+      handler();
+    }
+  }
+}
+
+static void* do_new_nothrow(size_t size, size_t alignment) noexcept {
+  try {
+    return do_new(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept { return do_malloc(size); }
+
+void free(void* ptr) noexcept { hc_free(ptr); }
+
+void* calloc(size_t n, size_t size) noexcept {
+  size_t total = 0;
+  if (__builtin_mul_overflow(n, size, &total)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  try {
+    return hc_calloc(1, malloc_size(total));
+  } catch (...) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+}
+
+void* realloc(void* ptr, size_t size) noexcept { return do_realloc(ptr, size); }
+
+// glibc 的 reallocarray 直接调用内部的 realloc，不会经过上面的 realloc
+void* reallocarray(void* ptr, size_t n, size_t size) noexcept {
+  size_t total = 0;
+  if (__builtin_mul_overflow(n, size, &total)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return do_realloc(ptr, total);
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+  if (!is_power_of_two(alignment) || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+  void* ptr = do_memalign(alignment, size);
+  if (ptr == nullptr) {
+    return ENOMEM;
+  }
+  *out = ptr;
+  return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+  if (!is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return do_memalign(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+  if (!is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return do_memalign(alignment, size);
+}
+
+void* valloc(size_t size) noexcept {
+  return do_memalign(SYSTEM_PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) noexcept {
+  return do_memalign(SYSTEM_PAGE_SIZE,
+                     AlignMap::align_upwards(size == 0 ? 1 : size,
+                                             SYSTEM_PAGE_SIZE));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+  return hc_malloc_usable_size(ptr);
+}
+
+// C23 的 free_sized，size 和申请时的大小相同
+void free_sized(void* ptr, size_t size) noexcept {
+  hc_free_sized(ptr, malloc_size(size));
+}
+
+int malloc_trim(size_t) noexcept { return hc_trim() > 0 ? 1 : 0; }
+
+}  // extern "C"
+
+void* operator new(size_t size) { return do_new(size, 0); }
+void* operator new[](size_t size) { return do_new(size, 0); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return do_new_nothrow(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return do_new_nothrow(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  return do_new(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return do_new(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return do_new_nothrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return do_new_nothrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { hc_free(ptr); }
+void operator delete[](void* ptr) noexcept { hc_free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { hc_free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  hc_free(ptr);
+}
+
+// sized delete 按 operator new 的取整规则得到 size class，不需要查页表
+void operator delete(void* ptr, size_t size) noexcept {
+  hc_free_sized(ptr, malloc_size(size));
+}
+void operator delete[](void* ptr, size_t size) noexcept {
+  hc_free_sized(ptr, malloc_size(size));
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept { hc_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { hc_free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  hc_free(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  hc_free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  hc_free(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  hc_free(ptr);
+}
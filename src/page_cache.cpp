@@ -1,88 +1,248 @@
 #include "page_cache.h"
 
-PageCache PageCache::page_cache_instance_;
+#include "scavenger.h"
 
-PageCache* PageCache::GetInstance() { return &page_cache_instance_; }
+PageMap<48 - kPageShift> PageCache::page_id_span_map_;
+PageMap<48 - kHugePageShift> PageCache::region_map_;
+
+PageCache* PageCache::GetInstance() {
+  return Instances::get(Numa::GetInstance()->current_node());
+}
+
+PageCache* PageCache::GetInstance(size_t node) { return Instances::get(node); }
 
 Span* PageCache::new_span(size_t page_count) {
   assert(page_count > 0);
+  new_spans_.add();
 
   // 大于 128 个页的 span 直接从系统中获取
   if (page_count > N_PAGES_BUCKET - 1) {
-    // Span* span = new Span;
-    Span* span = span_pool_.New();
-    void* ptr = system_alloc(page_count);
+    Span* span = new_span_object();
+    void* ptr = node_alloc(page_count);
     span->page_id_ = reinterpret_cast<size_t>(ptr) >> kPageShift;
     span->n_pages_ = page_count;
+    span->is_used_ = true;
+    span->zeroed_ = true;  // 匿名映射的页全为 0
 
     // 记录 page_id_ 和 span 的映射关系
-    // page_id_span_map_[span->page_id_] = span;
-    // page_id_span_map_[span->page_id_ + span->n_pages_ - 1] = span;
-    page_id_span_map_.set(span->page_id_, span);
-    page_id_span_map_.set(span->page_id_ + span->n_pages_ - 1, span);
+    map_span_bounds(span);
     return span;
   }
 
-  // 检查 page_count 对应的桶里有没有 span，如果有就直接返回
-  if (!span_lists_[page_count].empty()) {
-    Span* span = span_lists_[page_count].pop_front();
+  // 先检查 page_count 对应的桶，没有再从后面的桶里查找并进行拆分
+  // 每次只锁一个桶，精确命中时只需要加这一个桶的锁
+  for (size_t i = page_count; i < N_PAGES_BUCKET; ++i) {
+    Span* span = pop_span(i);
+    if (span != nullptr) {
+      return split_span(span, page_count);
+    }
+  }
+
+  // 说明已经没有足够大的 span 可以切分了，只能从系统中获取
+  // 大页模式下申请一整个 2MB 区域
+  if (hugepage_mode_.load(std::memory_order_relaxed)) {
+    return split_span(new_huge_region(), page_count);
+  }
+
+  // 从系统中申请 128 页的 span，直接切分，不先挂到桶里，避免被其他线程抢走
+  Span* system_allocated_span = new_span_object();
+  void* ptr = node_alloc(N_PAGES_BUCKET - 1);  // 128 个页
+  system_allocated_span->page_id_ =
+      reinterpret_cast<size_t>(ptr) / SYSTEM_PAGE_SIZE;
+  system_allocated_span->n_pages_ = N_PAGES_BUCKET - 1;
+  // 新映射的页还没有被访问过，不占物理内存，和已归还的页一样
+  system_allocated_span->returned_ = true;
+  system_allocated_span->zeroed_ = true;
+
+  return split_span(system_allocated_span, page_count);
+}
+
+Span* PageCache::new_aligned_span(size_t page_count, size_t align_pages) {
+  assert(page_count > 0);
+  assert((align_pages & (align_pages - 1)) == 0);
+  if (align_pages <= 1) {
+    return new_span(page_count);
+  }
+
+  // 先在桶里找一个本身就包含对齐区间的空闲 span，只切下需要的部分，
+  // 不必为了对齐多申请页，也不会切碎其他的大 span
+  if (page_count < N_PAGES_BUCKET) {
+    Span* span = take_aligned_free_span(page_count, align_pages);
+    if (span != nullptr) {
+      new_spans_.add();
+      size_t head = AlignMap::align_upwards(span->page_id_, align_pages) -
+                    span->page_id_;
+      if (head > 0) {
+        // 对齐位置之前的页仍然空闲，直接挂回对应的桶
+        splits_.add();
+        Span* front = new_span_object();
+        front->page_id_ = span->page_id_;
+        front->n_pages_ = head;
+        front->returned_ = span->returned_;
+        front->zeroed_ = span->zeroed_;
+        front->free_since_ = span->free_since_;
+        span->page_id_ += head;
+        span->n_pages_ -= head;
+        map_span_bounds(front);
+        push_span(front);
+      }
+      // 从对齐位置切下 page_count 页，剩余的页挂回桶中
+      return split_span(span, page_count);
+    }
+  }
+
+  Span* span = new_span(page_count + align_pages - 1);
+  size_t aligned_id = AlignMap::align_upwards(span->page_id_, align_pages);
+  size_t head = aligned_id - span->page_id_;
+  size_t tail = span->n_pages_ - head - page_count;
 
-    // 建立页号和 span 的映射关系
-    for (size_t i = 0; i < span->n_pages_; ++i) {
-      // page_id_span_map_[span->page_id_ + i] = span;
-      page_id_span_map_.set(span->page_id_ + i, span);
+  if (span->n_pages_ > N_PAGES_BUCKET - 1) {
+    // 直接向系统申请的 span，首尾多出的页直接还给系统
+    page_id_span_map_.set(span->page_id_, nullptr);
+    page_id_span_map_.set(span->page_id_ + span->n_pages_ - 1, nullptr);
+    if (head > 0) {
+      system_dealloc(reinterpret_cast<void*>(span->page_id_ << kPageShift),
+                     head);
     }
+    if (tail > 0) {
+      system_dealloc(
+          reinterpret_cast<void*>((aligned_id + page_count) << kPageShift),
+          tail);
+    }
+    system_dealloc_bytes_.add((head + tail) << kPageShift);
+
+    span->page_id_ = aligned_id;
+    span->n_pages_ = page_count;
+    map_span_bounds(span);
     return span;
   }
 
-  // 没有找到，就从后面的桶里查找并进行拆分
-  for (size_t i = page_count + 1; i < N_PAGES_BUCKET; ++i) {
-    if (!span_lists_[i].empty()) {
-      // 大块 span
-      Span* span = span_lists_[i].pop_front();
-      // 切分下来的小块 span 作为返回值，无需插入到 span_lists_ 中
-      // Span* split = new Span;
-      Span* split = span_pool_.New();
-      split->page_id_ = span->page_id_;
-      split->n_pages_ = page_count;
-
-      // 切分之后的剩余页面应该放到新的桶中，插入到 span_lists_ 中
-      span->page_id_ += page_count;
-      span->n_pages_ -= page_count;
-      span_lists_[span->n_pages_].push_front(span);
-
-      // page cache 中的映射关系，方便 page cache 进行回收
-      // page_id_span_map_[span->page_id_] = span;
-      // page_id_span_map_[span->page_id_ + span->n_pages_ - 1] = span;
-      page_id_span_map_.set(span->page_id_, span);
-      page_id_span_map_.set(span->page_id_ + span->n_pages_ - 1, span);
-
-      // 返回切分下来的小块 span，方便 central cache
-      // 回收小块内存时查找对应的span
-      for (size_t i = 0; i < page_count; ++i) {
-        // page_id_span_map_[split->page_id_ + i] = split;
-        page_id_span_map_.set(split->page_id_ + i, split);
-      }
+  // 从桶中切下来的 span，首尾多出的页作为单独的 span 还回 page cache
+  if (head > 0) {
+    Span* front = new_span_object();
+    front->page_id_ = span->page_id_;
+    front->n_pages_ = head;
+    front->is_used_ = true;
+    front->returned_ = span->returned_;
+    span->page_id_ = aligned_id;
+    span->n_pages_ -= head;
+    release_span_to_page_cache(front);
+  }
+  if (tail > 0) {
+    Span* back = new_span_object();
+    back->page_id_ = aligned_id + page_count;
+    back->n_pages_ = tail;
+    back->is_used_ = true;
+    back->returned_ = span->returned_;
+    span->n_pages_ = page_count;
+    release_span_to_page_cache(back);
+  }
+  return span;
+}
+
+Span* PageCache::take_aligned_free_span(size_t page_count,
+                                        size_t align_pages) {
+  for (size_t i = page_count; i < N_PAGES_BUCKET; ++i) {
+    PageBucket& span_list = span_lists_[i];
+    if (span_list.empty()) {
+      continue;
+    }
 
-      return split;
+    std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+    size_t scanned = 0;
+    for (Span* span = span_list.begin();
+         span != span_list.end() && scanned < kAlignedScanLimit;
+         span = span->next_, ++scanned) {
+      size_t aligned_id = AlignMap::align_upwards(span->page_id_, align_pages);
+      if (aligned_id + page_count > span->page_id_ + span->n_pages_) {
+        continue;
+      }
+      span_list.erase(span);
+      span->page_cache_bucket_.store(0, std::memory_order_relaxed);
+      if (HugeRegion* region = region_of(span->page_id_)) {
+        region->free_pages_.fetch_sub(span->n_pages_,
+                                      std::memory_order_relaxed);
+      }
+      return span;
     }
   }
+  return nullptr;
+}
 
-  // 说明已经没有足够大的 span 可以切分了，只能从系统中获取
-  // 从系统中申请 128 页的 span
-  // Span* system_allocated_span = new Span;
-  Span* system_allocated_span = span_pool_.New();
-  void* ptr = system_alloc(N_PAGES_BUCKET - 1);  // 128 个页
-  system_allocated_span->page_id_ =
-      reinterpret_cast<size_t>(ptr) / SYSTEM_PAGE_SIZE;
-  system_allocated_span->n_pages_ = N_PAGES_BUCKET - 1;
+Span* PageCache::pop_span(size_t bucket) {
+  PageBucket& span_list = span_lists_[bucket];
 
-  // 新页插入到 span_lists_ 中
-  span_lists_[system_allocated_span->n_pages_].push_front(
-      system_allocated_span);
+  // 不加锁先看一眼，空桶直接跳过
+  if (span_list.empty()) {
+    return nullptr;
+  }
+
+  std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+  if (span_list.empty()) {
+    return nullptr;
+  }
+  Span* span = span_list.pop_front();
+  span->page_cache_bucket_.store(0, std::memory_order_relaxed);
+  if (HugeRegion* region = region_of(span->page_id_)) {
+    region->free_pages_.fetch_sub(span->n_pages_, std::memory_order_relaxed);
+  }
+  return span;
+}
+
+void PageCache::push_span(Span* span) {
+  PageBucket& span_list = span_lists_[span->n_pages_];
+  HugeRegion* region = region_of(span->page_id_);
+
+  std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+  // 整个大页区域都空闲时挂到桶尾，优先从已经部分使用的区域中分配，
+  // 让使用中的页集中在尽量少的大页里
+  if (region != nullptr &&
+      region->free_pages_.fetch_add(span->n_pages_,
+                                    std::memory_order_relaxed) +
+              span->n_pages_ ==
+          HUGE_PAGE_PAGES) {
+    span_list.insert(span_list.end(), span);
+  } else {
+    span_list.push_front(span);
+  }
+  span->page_cache_bucket_.store(span->n_pages_, std::memory_order_release);
+}
+
+Span* PageCache::split_span(Span* span, size_t page_count) {
+  assert(span->n_pages_ >= page_count);
+
+  if (span->n_pages_ > page_count) {
+    // 切分下来的小块 span 作为返回值，无需插入到 span_lists_ 中
+    splits_.add();
+    Span* split = new_span_object();
+    split->page_id_ = span->page_id_;
+    split->n_pages_ = page_count;
+    split->zeroed_ = span->zeroed_;
+
+    // 切分之后的剩余页面应该放到新的桶中，插入到 span_lists_ 中
+    // 先建立首尾页的映射再挂入桶中，方便 page cache 进行回收
+    span->page_id_ += page_count;
+    span->n_pages_ -= page_count;
+    map_span_bounds(span);
+    push_span(span);
+
+    span = split;
+  }
 
-  // 递归给第二次 span 拆分调用
-  return new_span(page_count);
+  // 返回的 span 每一页都建立映射，方便 central cache
+  // 回收小块内存时查找对应的span
+  // 已归还的页再次访问时由内核重新分配，交出去之后就不再算作已归还
+  span->is_used_ = true;
+  span->returned_ = false;
+  map_span_pages(span);
+
+  // 整块归还过的大页区域重新开始使用
+  HugeRegion* region = region_of(span->page_id_);
+  if (region != nullptr &&
+      region->released_.exchange(false, std::memory_order_relaxed)) {
+    released_region_count_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return span;
 }
 
 Span* PageCache::get_span_by_address(void* ptr) {
@@ -101,104 +261,448 @@ Span* PageCache::get_span_by_address(void* ptr) {
   return ret;
 }
 
+// 页表中记录的是桶号 + 1，0 表示没有记录
+void PageCache::map_size_class(Span* span) {
+  page_id_span_map_.set_size_class(span->page_id_, span->n_pages_,
+                                   static_cast<uint8_t>(span->size_class_ + 1));
+}
+
+void PageCache::unmap_size_class(Span* span) {
+  page_id_span_map_.set_size_class(span->page_id_, span->n_pages_, 0);
+}
+
+bool PageCache::get_size_class(void* ptr, size_t& index) {
+  size_t page_id = reinterpret_cast<size_t>(ptr) >> kPageShift;
+  uint8_t size_class = page_id_span_map_.get_size_class(page_id);
+  if (size_class == 0) {
+    return false;
+  }
+  index = size_class - 1;
+  return true;
+}
+
+Span* PageCache::take_neighbour(size_t page_id, Span* span, bool is_prev) {
+  Span* neighbour = static_cast<Span*>(page_id_span_map_.get(page_id));
+
+  // 没有相邻的页，或者相邻的页属于其他节点，无法合并
+  // span 对象只在所属节点的对象池中复用，node_ 创建后不会改变，可以不加锁读取
+  if (neighbour == nullptr || neighbour->node_ != node()) {
+    return nullptr;
+  }
+
+  // 合并超过 128 个页的 span，直接释放，不合并
+  size_t bucket = neighbour->page_cache_bucket_.load(std::memory_order_acquire);
+  if (bucket + span->n_pages_ > N_PAGES_BUCKET - 1) {
+    return nullptr;
+  }
+
+  // 不跨越大页区域的边界合并，区域要能整块归还
+  if (is_region_boundary(is_prev ? span->page_id_ : page_id)) {
+    return nullptr;
+  }
+
+  // 页号映射可能已经过时（邻居被其他线程合并或切分了），
+  // 加锁后再确认一次它确实和 span 相邻；上面读到的桶号也可能已经过时，
+  // 邻居在这期间被合并得更大时，合并后会超过 128 页，要按加锁后的页数再检查一次
+  return take_free_span(neighbour, [&](Span* candidate) {
+    return candidate->n_pages_ + span->n_pages_ <= N_PAGES_BUCKET - 1 &&
+           (is_prev
+                ? candidate->page_id_ + candidate->n_pages_ == span->page_id_
+                : candidate->page_id_ == page_id);
+  });
+}
+
+bool PageCache::is_region_boundary(size_t boundary) const {
+  return boundary % HUGE_PAGE_PAGES == 0 &&
+         (region_of(boundary) != nullptr || region_of(boundary - 1) != nullptr);
+}
+
+bool PageCache::resize_span(Span* span, size_t page_count) {
+  assert(span->is_used_ && span->node_ == node() && page_count > 0);
+  size_t old_pages = span->n_pages_;
+  if (page_count == old_pages) {
+    return true;
+  }
+
+  // 直接向系统申请的 span，由内核重新映射，不复制数据
+  if (old_pages > N_PAGES_BUCKET - 1) {
+    if (page_count <= N_PAGES_BUCKET - 1) {
+      return false;
+    }
+    void* old_ptr = reinterpret_cast<void*>(span->page_id_ << kPageShift);
+    void* ptr = system_realloc(old_ptr, old_pages, page_count);
+    if (ptr == nullptr) {
+      return false;
+    }
+    page_id_span_map_.set(span->page_id_, nullptr);
+    page_id_span_map_.set(span->page_id_ + old_pages - 1, nullptr);
+    span->page_id_ = reinterpret_cast<size_t>(ptr) >> kPageShift;
+    span->n_pages_ = page_count;
+    map_span_bounds(span);
+    if (page_count > old_pages) {
+      system_alloc_bytes_.add((page_count - old_pages) << kPageShift);
+    } else {
+      system_dealloc_bytes_.add((old_pages - page_count) << kPageShift);
+    }
+    return true;
+  }
+
+  // 桶里的 span 最多 128 页
+  if (page_count > N_PAGES_BUCKET - 1) {
+    return false;
+  }
+
+  if (page_count < old_pages) {
+    // 缩小：尾部切下来作为单独的 span 还回 page cache，可以和后面的空闲页合并
+    splits_.add();
+    Span* back = new_span_object();
+    back->page_id_ = span->page_id_ + page_count;
+    back->n_pages_ = old_pages - page_count;
+    back->is_used_ = true;
+    span->n_pages_ = page_count;
+    release_span_to_page_cache(back);
+    return true;
+  }
+
+  // 增大：和 release_span_to_page_cache 向后合并一样，通过页号映射找到紧挨着的
+  // 下一个 span，它空闲、属于本节点并且不在大页区域边界的另一侧时才能吞并
+  size_t next_id = span->page_id_ + old_pages;
+  Span* neighbour = static_cast<Span*>(page_id_span_map_.get(next_id));
+  if (neighbour == nullptr || neighbour->node_ != node() ||
+      is_region_boundary(next_id)) {
+    return false;
+  }
+  Span* next = take_free_span(
+      neighbour, [&](Span* candidate) { return candidate->page_id_ == next_id; });
+  if (next == nullptr) {
+    return false;
+  }
+  size_t needed = page_count - old_pages;
+  if (next->n_pages_ < needed) {
+    // 空闲的页不够，原样挂回去
+    push_span(next);
+    return false;
+  }
+
+  // 和 split_span 一样，交出去的 span 每一页都建立映射
+  coalesces_.add();
+  span->n_pages_ = page_count;
+  for (size_t i = old_pages; i < page_count; ++i) {
+    page_id_span_map_.set(span->page_id_ + i, span);
+  }
+  if (next->n_pages_ == needed) {
+    delete_span_object(next);
+  } else {
+    // 剩余的页仍然空闲，保留原来的归还状态和空闲时间
+    next->page_id_ += needed;
+    next->n_pages_ -= needed;
+    map_span_bounds(next);
+    push_span(next);
+  }
+  return true;
+}
+
+template <class Match>
+Span* PageCache::take_free_span(Span* candidate, Match match) {
+  // 正在使用（不在 page cache 的桶里）的 span 不能摘
+  size_t bucket = candidate->page_cache_bucket_.load(std::memory_order_acquire);
+  if (bucket == 0) {
+    return nullptr;
+  }
+
+  PageBucket& span_list = span_lists_[bucket];
+  std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+  if (candidate->page_cache_bucket_.load(std::memory_order_relaxed) !=
+          bucket ||
+      !match(candidate)) {
+    return nullptr;
+  }
+
+  // 从 span_lists_ 中移除
+  span_list.erase(candidate);
+  candidate->page_cache_bucket_.store(0, std::memory_order_relaxed);
+  if (HugeRegion* region = region_of(candidate->page_id_)) {
+    region->free_pages_.fetch_sub(candidate->n_pages_,
+                                  std::memory_order_relaxed);
+  }
+  return candidate;
+}
+
 void PageCache::release_span_to_page_cache(Span* span) {
+  release_spans(&span, 1);
+}
+
+void PageCache::release_spans(Span* const* spans, size_t n) {
+  size_t now = monotonic_ms();
+  for (size_t i = 0; i < n; ++i) {
+    insert_free_span(spans[i], now);
+  }
+
+  // 开启了 lazy 回收时，顺便检查是否需要把空闲页还给操作系统
+  Scavenger::GetInstance()->maybe_scavenge();
+}
+
+void PageCache::insert_free_span(Span* span, size_t now) {
   // 大于 128 个页的 span 直接释放
   if (span->n_pages_ > N_PAGES_BUCKET - 1) {
     void* ptr = reinterpret_cast<void*>(span->page_id_ << kPageShift);
+    page_id_span_map_.set(span->page_id_, nullptr);
+    page_id_span_map_.set(span->page_id_ + span->n_pages_ - 1, nullptr);
     system_dealloc(ptr, span->n_pages_);
+    system_deallocs_.add();
+    system_dealloc_bytes_.add(static_cast<size_t>(span->n_pages_) << kPageShift);
 
     // 释放 span 对象
-    // delete span;
-    span_pool_.Delete(span);
+    delete_span_object(span);
     return;
   }
 
+  // 交出去的页可能已经被写过，不再认为是全 0
+  span->zeroed_ = false;
+
   // 对 span 前后的页尝试进行合并，缓解内存碎片问题
-  while (1) {
-    size_t prev_page_id = span->page_id_ - 1;
+  // span 此时不在任何桶中，其他线程不会把它当作邻居摘走
+  while (Span* prev_span = take_neighbour(span->page_id_ - 1, span, true)) {
+    // 合并前后两个 span，只有两部分都已归还时合并结果才算已归还
+    span->page_id_ = prev_span->page_id_;
+    span->n_pages_ += prev_span->n_pages_;
+    span->returned_ = span->returned_ && prev_span->returned_;
+    span->zeroed_ = span->zeroed_ && prev_span->zeroed_;
+    delete_span_object(prev_span);
+    coalesces_.add();
+  }
 
-    // auto prev_it = page_id_span_map_.find(prev_page_id);
+  // 向后合并
+  while (Span* next_span =
+             take_neighbour(span->page_id_ + span->n_pages_, span, false)) {
+    span->n_pages_ += next_span->n_pages_;
+    span->returned_ = span->returned_ && next_span->returned_;
+    span->zeroed_ = span->zeroed_ && next_span->zeroed_;
+    delete_span_object(next_span);
+    coalesces_.add();
+  }
 
-    // // 前面没有页了，无法合并
-    // if (prev_it == page_id_span_map_.end()) {
-    //   break;
-    // }
+  // 将合并后的 span 插入到新的桶中，插入到 span_lists_ 中
+  span->is_used_ = false;
+  span->free_since_ = now;
+  map_span_bounds(span);
+  push_span(span);
+}
 
-    // // 前面的页是被占用的，无法合并
-    // Span* prev_span = prev_it->second;
+size_t PageCache::release_free_spans(size_t decay_ms, bool lazy) {
+  size_t now = monotonic_ms();
+  size_t released = 0;
+
+  // 大页区域只整块归还，不拆散大页
+  if (region_count_.load(std::memory_order_relaxed) != 0) {
+    released += release_free_regions(now, decay_ms, lazy);
+  }
 
-    Span* prev_span = static_cast<Span*>(page_id_span_map_.get(prev_page_id));
+  for (size_t i = 1; i < N_PAGES_BUCKET; ++i) {
+    PageBucket& span_list = span_lists_[i];
+    if (span_list.empty()) {
+      continue;
+    }
 
-    // 前面没有页了，无法合并
-    if (prev_span == nullptr) {
-      break;
+    std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+    for (Span* span = span_list.begin(); span != span_list.end();
+         span = span->next_) {
+      if (span->returned_ || now - span->free_since_ < decay_ms ||
+          region_of(span->page_id_) != nullptr) {
+        continue;
+      }
+      if (system_release(reinterpret_cast<void*>(span->page_id_ << kPageShift),
+                         span->n_pages_, lazy)) {
+        span->zeroed_ = true;
+      }
+      span->returned_ = true;
+      released += static_cast<size_t>(span->n_pages_) << kPageShift;
     }
+  }
+  return released;
+}
 
-    // 前面的页是被占用的，无法合并
-    if (prev_span->is_used_ == true) {
-      break;
+size_t PageCache::release_free_regions(size_t now, size_t decay_ms,
+                                       bool lazy) {
+  HugeRegion* region = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(region_lock_);
+    region = regions_;
+  }
+
+  size_t released = 0;
+  for (; region != nullptr; region = region->next_) {
+    if (region->released_.load(std::memory_order_relaxed) ||
+        region->free_pages_.load(std::memory_order_relaxed) !=
+            HUGE_PAGE_PAGES) {
+      continue;
     }
 
-    // 合并超过 128 个页的 span，直接释放，不合并
-    if (prev_span->n_pages_ + span->n_pages_ > N_PAGES_BUCKET - 1) {
-      break;
+    // 把区域中的 span 依次从桶里摘下来，保证归还期间没有线程能分配到它们
+    Span* spans[HUGE_PAGE_PAGES];
+    size_t n_spans = 0;
+    bool idle = true;
+    size_t page_id = region->first_page_;
+    while (page_id < region->first_page_ + HUGE_PAGE_PAGES) {
+      Span* candidate = static_cast<Span*>(page_id_span_map_.get(page_id));
+      Span* span = candidate == nullptr
+                       ? nullptr
+                       : take_free_span(candidate, [&](Span* c) {
+                           return c->page_id_ == page_id;
+                         });
+      if (span == nullptr) {
+        break;
+      }
+      spans[n_spans++] = span;
+      idle = idle && now - span->free_since_ >= decay_ms;
+      page_id += span->n_pages_;
     }
 
-    // 合并前后两个 span
-    span->page_id_ = prev_span->page_id_;
-    span->n_pages_ += prev_span->n_pages_;
+    bool whole = page_id == region->first_page_ + HUGE_PAGE_PAGES;
+    bool zeroed = false;
+    if (whole && idle) {
+      zeroed = system_release(
+          reinterpret_cast<void*>(region->first_page_ << kPageShift),
+          HUGE_PAGE_PAGES, lazy);
+      region->released_.store(true, std::memory_order_relaxed);
+      released_region_count_.fetch_add(1, std::memory_order_relaxed);
+      released += HUGE_PAGE_PAGES << kPageShift;
+    }
 
-    // 从 span_lists_ 中移除
-    span_lists_[prev_span->n_pages_].erase(prev_span);
-    // delete prev_span;
-    span_pool_.Delete(prev_span);
+    for (size_t i = 0; i < n_spans; ++i) {
+      if (whole && idle) {
+        spans[i]->returned_ = true;
+        spans[i]->zeroed_ = spans[i]->zeroed_ || zeroed;
+      }
+      push_span(spans[i]);
+    }
   }
+  return released;
+}
 
-  // 向后合并
-  while (1) {
-    size_t next_page_id = span->page_id_ + span->n_pages_;
-    // auto next_it = page_id_span_map_.find(next_page_id);
+bool PageCache::set_hugepage_mode(bool enable) {
+#if defined(_WIN32) || !defined(MADV_HUGEPAGE)
+  enable = false;
+#endif
+  hugepage_mode_.store(enable, std::memory_order_relaxed);
+  return enable;
+}
 
-    // // 后面没有页了，无法合并
-    // if (next_it == page_id_span_map_.end()) {
-    //   break;
-    // }
+size_t PageCache::hugepage_reserved_bytes() const {
+  return region_count_.load(std::memory_order_relaxed) << kHugePageShift;
+}
 
-    // // 后面的页是被占用的，无法合并
-    // Span* next_span = next_it->second;
+size_t PageCache::hugepage_released_bytes() const {
+  return released_region_count_.load(std::memory_order_relaxed)
+         << kHugePageShift;
+}
 
-    Span* next_span = static_cast<Span*>(page_id_span_map_.get(next_page_id));
+void* PageCache::node_alloc(size_t page_count) {
+  void* ptr = system_alloc(page_count);
+  Numa::GetInstance()->bind(ptr, page_count, node());
+  // 新内存的页马上要建立映射，先把叶节点建好
+  page_id_span_map_.reserve(reinterpret_cast<size_t>(ptr) >> kPageShift,
+                            page_count);
+  system_allocs_.add();
+  system_alloc_bytes_.add(page_count << kPageShift);
+  return ptr;
+}
 
-    // 后面没有页了，无法合并
-    if (next_span == nullptr) {
-      break;
+void PageCache::collect_stats(HcStats& stats) {
+  for (size_t i = 1; i < N_PAGES_BUCKET; ++i) {
+    PageBucket& span_list = span_lists_[i];
+    if (!span_list.empty()) {
+      std::lock_guard<BucketMutex> lock(span_list.bucket_lock_);
+      for (Span* span = span_list.begin(); span != span_list.end();
+           span = span->next_) {
+        size_t bytes = static_cast<size_t>(span->n_pages_) << kPageShift;
+        stats.page_cache_bytes += bytes;
+        if (span->returned_) {
+          stats.page_cache_returned_bytes += bytes;
+        }
+      }
     }
 
-    // 后面的页是被占用的，无法合并
-    if (next_span->is_used_ == true) {
-      break;
-    }
+    const BucketMutex& lock = span_list.bucket_lock_;
+    stats.page_locks.acquires += lock.acquires();
+    stats.page_locks.contended += lock.contended();
+    stats.page_locks.wait_ns += lock.wait_ns();
+  }
 
-    // 合并超过 128 个页的 span，直接释放，不合并
-    if (next_span->n_pages_ + span->n_pages_ > N_PAGES_BUCKET - 1) {
-      break;
-    }
+  stats.page_new_spans += new_spans_.get();
+  stats.page_splits += splits_.get();
+  stats.page_coalesces += coalesces_.get();
+  stats.system_allocs += system_allocs_.get();
+  stats.system_deallocs += system_deallocs_.get();
+  // 先读释放的字节数，并发释放时结果不会小于 0
+  size_t dealloc_bytes = system_dealloc_bytes_.get();
+  stats.system_bytes += system_alloc_bytes_.get() - dealloc_bytes;
+}
 
-    // 合并前后两个 span
-    span->n_pages_ += next_span->n_pages_;
+Span* PageCache::new_huge_region() {
+  void* ptr = system_alloc_huge(HUGE_PAGE_PAGES);
+  Numa::GetInstance()->bind(ptr, HUGE_PAGE_PAGES, node());
+  system_allocs_.add();
+  system_alloc_bytes_.add(HUGE_PAGE_PAGES << kPageShift);
+  size_t first_page = reinterpret_cast<size_t>(ptr) >> kPageShift;
+  page_id_span_map_.reserve(first_page, HUGE_PAGE_PAGES);
+
+  {
+    std::lock_guard<std::mutex> lock(region_lock_);
+    HugeRegion* region = region_pool_.New();
+    region->first_page_ = first_page;
+    region->next_ = regions_;
+    regions_ = region;
+    region_map_.set(first_page >> (kHugePageShift - kPageShift), region);
+  }
+  region_count_.fetch_add(1, std::memory_order_relaxed);
+
+  // 按 128 页切分，第一个返回给调用方切分，其余的挂进桶中
+  const size_t span_pages = N_PAGES_BUCKET - 1;
+  Span* first = nullptr;
+  for (size_t offset = 0; offset < HUGE_PAGE_PAGES; offset += span_pages) {
+    Span* span = new_span_object();
+    span->page_id_ = first_page + offset;
+    span->n_pages_ = span_pages;
+    span->returned_ = true;
+    span->zeroed_ = true;
+    if (first == nullptr) {
+      first = span;
+    } else {
+      map_span_bounds(span);
+      push_span(span);
+    }
+  }
+  return first;
+}
 
-    // 从 span_lists_ 中移除
-    span_lists_[next_span->n_pages_].erase(next_span);
-    // delete next_span;
-    span_pool_.Delete(next_span);
+HugeRegion* PageCache::region_of(size_t page_id) const {
+  if (region_count_.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
   }
+  return static_cast<HugeRegion*>(
+      region_map_.get(page_id >> (kHugePageShift - kPageShift)));
+}
 
-  // 将合并后的 span 插入到新的桶中，插入到 span_lists_ 中
-  span_lists_[span->n_pages_].push_front(span);
-  span->is_used_ = false;
-  // page_id_span_map_[span->page_id_] = span;
-  // page_id_span_map_[span->page_id_ + span->n_pages_ - 1] = span;
+void PageCache::map_span_pages(Span* span) {
+  for (size_t i = 0; i < span->n_pages_; ++i) {
+    page_id_span_map_.set(span->page_id_ + i, span);
+  }
+}
 
+void PageCache::map_span_bounds(Span* span) {
   page_id_span_map_.set(span->page_id_, span);
   page_id_span_map_.set(span->page_id_ + span->n_pages_ - 1, span);
-}
\ No newline at end of file
+}
+
+Span* PageCache::new_span_object() {
+  std::lock_guard<std::mutex> lock(span_pool_lock_);
+  Span* span = span_pool_.New();
+  span->node_ = static_cast<uint8_t>(node());
+  return span;
+}
+
+void PageCache::delete_span_object(Span* span) {
+  std::lock_guard<std::mutex> lock(span_pool_lock_);
+  span_pool_.Delete(span);
+}
@@ -0,0 +1,85 @@
+#include "scavenger.h"
+
+#include "page_cache.h"
+
+Scavenger* Scavenger::GetInstance() { return LeakyInstances<Scavenger>::get(); }
+
+size_t monotonic_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Scavenger::start(size_t interval_ms, size_t decay_ms) {
+  stop();
+
+  std::lock_guard<std::mutex> lock(thread_lock_);
+  running_ = true;
+  thread_ = std::thread(&Scavenger::run, this, interval_ms, decay_ms);
+}
+
+void Scavenger::stop() {
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(thread_lock_);
+    running_ = false;
+    thread.swap(thread_);
+  }
+  cv_.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void Scavenger::run(size_t interval_ms, size_t decay_ms) {
+  std::unique_lock<std::mutex> lock(thread_lock_);
+  while (running_) {
+    if (cv_.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                     [this]() { return !running_; })) {
+      break;
+    }
+
+    // 回收时不持有线程锁，stop() 不会被一次回收阻塞太久
+    lock.unlock();
+    scavenge(decay_ms);
+    lock.lock();
+  }
+}
+
+void Scavenger::set_lazy(size_t interval_ms, size_t decay_ms) {
+  lazy_decay_ms_.store(decay_ms, std::memory_order_relaxed);
+  lazy_interval_ms_.store(interval_ms, std::memory_order_relaxed);
+}
+
+void Scavenger::maybe_scavenge() {
+  size_t interval = lazy_interval_ms_.load(std::memory_order_relaxed);
+  if (interval == 0) {
+    return;
+  }
+
+  size_t now = monotonic_ms();
+  size_t last = last_scavenge_ms_.load(std::memory_order_relaxed);
+  if (now - last < interval) {
+    return;
+  }
+
+  // 多个线程同时到期时只让一个线程回收
+  if (last_scavenge_ms_.compare_exchange_strong(last, now,
+                                                std::memory_order_relaxed)) {
+    scavenge(lazy_decay_ms_.load(std::memory_order_relaxed));
+  }
+}
+
+void Scavenger::set_madv_free(bool enable) {
+  madv_free_.store(enable, std::memory_order_relaxed);
+}
+
+size_t Scavenger::scavenge(size_t decay_ms) {
+  // 关闭 NUMA 感知后其他节点的 page cache 中仍可能有空闲页，所有节点都要回收
+  size_t released = 0;
+  for (size_t node = 0; node < MAX_NUMA_NODES; ++node) {
+    released += PageCache::GetInstance(node)->release_free_spans(
+        decay_ms, madv_free_.load(std::memory_order_relaxed));
+  }
+  return released;
+}
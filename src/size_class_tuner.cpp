@@ -0,0 +1,47 @@
+#include "size_class_tuner.h"
+
+SizeClassTuner* SizeClassTuner::GetInstance() {
+  return LeakyInstances<SizeClassTuner>::get();
+}
+
+SizeClassTuner::SizeClassTuner() {
+  for (size_t index = 0; index < N_FREE_LIST; ++index) {
+    Class& c = classes_[index];
+    size_t size = AlignMap::class_to_size(index);
+    size_t base = AlignMap::calculate_num_objects(size);
+    // 一批最多 1MB，大对象不会因为加倍占用太多 thread cache 预算
+    size_t max_batch = (std::min)(base * 4, (4 * MAX_BYTES) / size);
+    c.min_batch_ = (std::max)(base / 4, static_cast<size_t>(2));
+    c.max_batch_ = (std::max)(max_batch, base);
+    c.batch_.store(base, std::memory_order_relaxed);
+  }
+}
+
+void SizeClassTuner::record(size_t index, bool refill) {
+  Class& c = classes_[index];
+  std::atomic<size_t>& counter = refill ? c.refills_ : c.overflows_;
+  counter.fetch_add(1, std::memory_order_relaxed);
+
+  size_t refills = c.refills_.load(std::memory_order_relaxed);
+  size_t overflows = c.overflows_.load(std::memory_order_relaxed);
+  if (refills + overflows < TUNE_WINDOW) {
+    return;
+  }
+
+  // 窗口满了，只让一个线程清零计数并调整，其他线程的这次事件计入下个窗口
+  if (!c.refills_.compare_exchange_strong(refills, 0,
+                                          std::memory_order_relaxed)) {
+    return;
+  }
+  c.overflows_.fetch_sub(overflows, std::memory_order_relaxed);
+
+  size_t batch = c.batch_.load(std::memory_order_relaxed);
+  if (refills > overflows * 2) {
+    // 经常取空：每次多取一些，减少访问 central cache 的次数
+    batch = (std::min)(batch * 2, c.max_batch_);
+  } else if (overflows > refills * 2) {
+    // 经常溢出：每次少取一些，thread cache 中闲置的对象更少
+    batch = (std::max)(batch / 2, c.min_batch_);
+  }
+  c.batch_.store(batch, std::memory_order_relaxed);
+}
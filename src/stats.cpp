@@ -0,0 +1,91 @@
+#include "stats.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace {
+
+// 向固定大小的缓冲区追加格式化的文本，缓冲区满了之后只累计长度
+class StatsWriter {
+ public:
+  StatsWriter(char* buf, size_t len) : buf_(buf), len_(len) {}
+
+  void printf(const char* format, ...) {
+    char* out = pos_ < len_ ? buf_ + pos_ : nullptr;
+    size_t remain = pos_ < len_ ? len_ - pos_ : 0;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out, remain, format, args);
+    va_end(args);
+    if (n > 0) {
+      pos_ += n;
+    }
+  }
+
+  size_t length() const { return pos_; }
+
+ private:
+  char* buf_;
+  size_t len_;
+  size_t pos_ = 0;
+};
+
+double to_mb(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+void print_locks(StatsWriter& out, const char* name, const HcLockStats& lock) {
+  out.printf("%-14s %14zu acquires %12zu contended (%.3f%%) %10.3f ms waited\n",
+             name, lock.acquires, lock.contended,
+             lock.acquires != 0 ? 100.0 * lock.contended / lock.acquires : 0.0,
+             lock.wait_ns / 1e6);
+}
+
+}  // namespace
+
+size_t format_stats(const HcStats& stats, char* buf, size_t len) {
+  if (len != 0) {
+    buf[0] = '\0';
+  }
+  StatsWriter out(buf, len);
+
+  out.printf("------------------------------------------------\n");
+  out.printf("MALLOC: %12.2f MB thread cache (%zu caches)\n",
+             to_mb(stats.thread_cache_bytes), stats.thread_caches);
+  out.printf("MALLOC: %12.2f MB transfer cache\n",
+             to_mb(stats.transfer_cache_bytes));
+  out.printf("MALLOC: %12.2f MB central cache (%zu spans)\n",
+             to_mb(stats.central_cache_bytes), stats.central_spans);
+  out.printf("MALLOC: %12.2f MB page cache (%.2f MB returned to OS)\n",
+             to_mb(stats.page_cache_bytes),
+             to_mb(stats.page_cache_returned_bytes));
+  out.printf("MALLOC: %12.2f MB mapped from OS\n", to_mb(stats.system_bytes));
+  out.printf("------------------------------------------------\n");
+  out.printf("central: %zu span fetches, %zu span releases, "
+             "transfer cache %zu hits / %zu misses\n",
+             stats.central_span_fetches, stats.central_span_releases,
+             stats.transfer_hits, stats.transfer_misses);
+  out.printf("page:    %zu new spans, %zu splits, %zu coalesces, "
+             "%zu system allocs, %zu system deallocs\n",
+             stats.page_new_spans, stats.page_splits, stats.page_coalesces,
+             stats.system_allocs, stats.system_deallocs);
+  out.printf("large:   %zu allocs, %zu frees\n", stats.large_allocs,
+             stats.large_frees);
+  print_locks(out, "central locks", stats.central_locks);
+  print_locks(out, "page locks", stats.page_locks);
+  out.printf("------------------------------------------------\n");
+  out.printf("%5s %8s %6s %12s %12s %8s %10s %10s %6s %10s %10s\n", "class",
+             "size", "batch", "allocs", "frees", "hit%", "misses",
+             "overflows", "spans", "central KB", "transfer KB");
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    const HcSizeClassStats& c = stats.classes[i];
+    if (c.allocs == 0 && c.frees == 0 && c.spans == 0) {
+      continue;
+    }
+    out.printf("%5zu %8zu %6zu %12zu %12zu %7.2f%% %10zu %10zu %6zu %10zu "
+               "%10zu\n",
+               i, c.size, c.batch_size, c.allocs, c.frees,
+               c.allocs != 0 ? 100.0 * c.hits / c.allocs : 0.0, c.misses,
+               c.overflows, c.spans, c.central_free_bytes >> 10,
+               c.transfer_bytes >> 10);
+  }
+  return out.length();
+}
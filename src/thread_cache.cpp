@@ -1,33 +1,316 @@
 #include "thread_cache.h"
 
 #include "central_cache.h"
+#include "heap_profiler.h"
+#include "page_cache.h"
+#include "size_class_tuner.h"
 
-// 使用C++11 thread_local + unique_ptr实现
-thread_local std::unique_ptr<ThreadCache> tls_thread_cache;
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
-// 线程退出时自动清理的保险措施
+// 当前线程的 thread cache
+// 作为 malloc 使用时，带构造/析构函数的 thread_local 在首次访问时会注册析构函数
+// （可能申请内存），所以这里只用一个普通指针，线程退出时的清理交给 pthread key
+static thread_local ThreadCache* tls_thread_cache = nullptr;
+
+#ifdef _WIN32
+// 线程退出时自动清理
 thread_local struct ThreadCacheCleanup {
-  ~ThreadCacheCleanup() {
-    if (tls_thread_cache) {
-      // 可以在这里将未释放的内存归还给中央缓存
-      tls_thread_cache.reset();
-    }
-  }
+  ~ThreadCacheCleanup() { DestroyThreadCache(); }
 } tls_cleanup;
 
+static void register_thread_cache(ThreadCache*) { (void)&tls_cleanup; }
+#else
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// ThreadCache 析构时会把未释放的内存归还给中央缓存
+// 之后其他 key 的析构函数还可能释放内存，那时会重新创建 thread cache 并再次
+// 设置 key，glibc 会再调用一轮析构函数
+static void thread_cache_key_destructor(void*) { DestroyThreadCache(); }
+
+static void create_thread_cache_key() {
+  pthread_key_create(&thread_cache_key, thread_cache_key_destructor);
+}
+
+static void register_thread_cache(ThreadCache* cache) {
+  pthread_once(&thread_cache_key_once, create_thread_cache_key);
+  pthread_setspecific(thread_cache_key, cache);
+}
+#endif
+
+// thread cache 直接向系统申请，不经过内存池自身
+static size_t thread_cache_pages() {
+  return AlignMap::align_upwards(sizeof(ThreadCache), SYSTEM_PAGE_SIZE) >>
+         kPageShift;
+}
+
 ThreadCache* GetThreadCache() {
-  if (!tls_thread_cache) {
-    tls_thread_cache = std::make_unique<ThreadCache>();
+  if (tls_thread_cache == nullptr) {
+    // 先设置指针再注册：注册时申请内存会直接用上这个 thread cache
+    tls_thread_cache = new (system_alloc(thread_cache_pages())) ThreadCache;
+    register_thread_cache(tls_thread_cache);
+  }
+  return tls_thread_cache;
+}
+
+size_t FlushThreadCache() {
+  // 不为没有使用过 thread cache 的线程创建缓存
+  return tls_thread_cache ? tls_thread_cache->flush() : 0;
+}
+
+void DestroyThreadCache() {
+  ThreadCache* cache = tls_thread_cache;
+  if (cache == nullptr) {
+    return;
+  }
+  // 析构过程中归还对象不会再用到这个 thread cache，先清掉指针
+  tls_thread_cache = nullptr;
+  cache->~ThreadCache();
+  system_dealloc(cache, thread_cache_pages());
+}
+
+ThreadCache* PeekThreadCache() { return tls_thread_cache; }
+
+std::mutex ThreadCache::registry_lock_;
+ThreadCache* ThreadCache::registry_head_ = nullptr;
+ThreadCache* ThreadCache::next_victim_ = nullptr;
+size_t ThreadCache::thread_count_ = 0;
+size_t ThreadCache::overall_budget_ = DEFAULT_THREAD_CACHE_BUDGET;
+long long ThreadCache::unclaimed_budget_ = DEFAULT_THREAD_CACHE_BUDGET;
+ThreadCache::RetiredCounters ThreadCache::retired_counters_[N_FREE_LIST];
+
+ThreadCache::ThreadCache() {
+  bytes_until_sample_ = HeapProfiler::GetInstance()->next_sample_interval();
+
+  std::lock_guard<std::mutex> lock(registry_lock_);
+
+  // 未分配的预算不够时仍然给最小值，预算暂时超出，其他线程缩小上限后会补回来
+  max_size_.store(MIN_THREAD_CACHE_SIZE, std::memory_order_relaxed);
+  unclaimed_budget_ -= MIN_THREAD_CACHE_SIZE;
+
+  next_ = registry_head_;
+  if (registry_head_ != nullptr) {
+    registry_head_->prev_ = this;
+  }
+  registry_head_ = this;
+  ++thread_count_;
+}
+
+ThreadCache::~ThreadCache() {
+  flush();
+
+  std::lock_guard<std::mutex> lock(registry_lock_);
+  unclaimed_budget_ += max_size_.load(std::memory_order_relaxed);
+#if HC_ENABLE_STATS
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    retired_counters_[i].allocs_.add(counters_[i].allocs_.get());
+    retired_counters_[i].frees_.add(counters_[i].frees_.get());
+    retired_counters_[i].misses_.add(counters_[i].misses_.get());
+    retired_counters_[i].overflows_.add(counters_[i].overflows_.get());
+  }
+#endif
+  if (next_victim_ == this) {
+    next_victim_ = next_;
+  }
+  if (prev_ != nullptr) {
+    prev_->next_ = next_;
+  } else {
+    registry_head_ = next_;
+  }
+  if (next_ != nullptr) {
+    next_->prev_ = prev_;
+  }
+  --thread_count_;
+}
+
+void ThreadCache::scavenge() {
+  // 低水位以下的对象从上次回收到现在一直没有用到，归还其中的一半
+  // 很久没用的对象会在几次之后全部归还
+  SizeClassTuner* tuner = SizeClassTuner::GetInstance();
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    FreeList& free_list = free_list_[i];
+    size_t low_water = free_list.low_water();
+    if (low_water > 0) {
+      // 按批归还，这样能放进 transfer cache，不需要马上拆回 span
+      size_t n = (low_water + 1) / 2;
+      size_t size = AlignMap::class_to_size(i);
+      size_t batch = tuner->batch_size(i);
+      size_.store(size_.load(std::memory_order_relaxed) - n * size,
+                  std::memory_order_relaxed);
+      while (n > 0) {
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t count = (std::min)(n, batch);
+        free_list.pop_range(start, end, count);
+        CentralCache::GetInstance()->release_range_objs(start, end, count,
+                                                        size);
+        n -= count;
+      }
+
+      // 容量也用不了这么多，收缩一批
+      if (free_list.max_size() > batch) {
+        free_list.max_size() = (std::max)(free_list.max_size() - batch, batch);
+      }
+    }
+    free_list.reset_low_water();
+  }
+
+  // 缓存会超出上限说明这个线程很活跃，尝试给它更多预算
+  std::lock_guard<std::mutex> lock(registry_lock_);
+  increase_cache_limit_locked();
+}
+
+void ThreadCache::increase_cache_limit_locked() {
+  size_t max_size = max_size_.load(std::memory_order_relaxed);
+  if (max_size >= MAX_THREAD_CACHE_SIZE) {
+    return;
+  }
+
+  if (unclaimed_budget_ >= static_cast<long long>(THREAD_CACHE_STEAL_AMOUNT)) {
+    unclaimed_budget_ -= THREAD_CACHE_STEAL_AMOUNT;
+    max_size_.store(max_size + THREAD_CACHE_STEAL_AMOUNT,
+                    std::memory_order_relaxed);
+    return;
+  }
+
+  // 轮流从其他 thread cache 那里偷，最多尝试 10 个，避免持锁太久
+  for (int i = 0; i < 10; ++i) {
+    if (next_victim_ == nullptr) {
+      next_victim_ = registry_head_;
+    }
+    ThreadCache* victim = next_victim_;
+    next_victim_ = victim->next_;
+
+    size_t victim_size = victim->max_size_.load(std::memory_order_relaxed);
+    if (victim == this ||
+        victim_size < MIN_THREAD_CACHE_SIZE + THREAD_CACHE_STEAL_AMOUNT) {
+      continue;
+    }
+
+    // 被偷的线程下次释放内存时发现超出上限，会自己归还多余的对象
+    victim->max_size_.store(victim_size - THREAD_CACHE_STEAL_AMOUNT,
+                            std::memory_order_relaxed);
+    max_size_.store(max_size + THREAD_CACHE_STEAL_AMOUNT,
+                    std::memory_order_relaxed);
+    return;
+  }
+}
+
+void ThreadCache::recompute_per_thread_size_locked() {
+  size_t n = (std::max)(thread_count_, static_cast<size_t>(1));
+  size_t space = (std::max)(overall_budget_ / n, MIN_THREAD_CACHE_SIZE);
+  space = (std::min)(space, MAX_THREAD_CACHE_SIZE);
+
+  long long claimed = 0;
+  for (ThreadCache* cache = registry_head_; cache != nullptr;
+       cache = cache->next_) {
+    cache->max_size_.store(space, std::memory_order_relaxed);
+    claimed += space;
+  }
+  unclaimed_budget_ = static_cast<long long>(overall_budget_) - claimed;
+}
+
+void ThreadCache::set_overall_budget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(registry_lock_);
+  overall_budget_ = (std::max)(bytes, MIN_THREAD_CACHE_SIZE);
+  recompute_per_thread_size_locked();
+}
+
+ThreadCacheStats ThreadCache::get_stats() {
+  ThreadCacheStats stats;
+  std::lock_guard<std::mutex> lock(registry_lock_);
+  stats.budget_bytes = overall_budget_;
+  stats.unclaimed_bytes =
+      unclaimed_budget_ > 0 ? static_cast<size_t>(unclaimed_budget_) : 0;
+  stats.thread_count = thread_count_;
+  for (ThreadCache* cache = registry_head_; cache != nullptr;
+       cache = cache->next_) {
+    size_t cached = cache->cached_bytes();
+    stats.cached_bytes += cached;
+    stats.max_cached_bytes = (std::max)(stats.max_cached_bytes, cached);
+  }
+  return stats;
+}
+
+void ThreadCache::collect_stats(HcStats& stats) {
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    HcSizeClassStats& c = stats.classes[i];
+    c.allocs += retired_counters_[i].allocs_.get();
+    c.frees += retired_counters_[i].frees_.get();
+    c.misses += retired_counters_[i].misses_.get();
+    c.overflows += retired_counters_[i].overflows_.get();
+  }
+
+  std::lock_guard<std::mutex> lock(registry_lock_);
+  for (ThreadCache* cache = registry_head_; cache != nullptr;
+       cache = cache->next_) {
+    for (size_t i = 0; i < N_FREE_LIST; ++i) {
+      HcSizeClassStats& c = stats.classes[i];
+      c.allocs += cache->counters_[i].allocs_.get();
+      c.frees += cache->counters_[i].frees_.get();
+      c.misses += cache->counters_[i].misses_.get();
+      c.overflows += cache->counters_[i].overflows_.get();
+    }
+    stats.thread_cache_bytes += cache->cached_bytes();
+  }
+  stats.thread_caches += thread_count_;
+
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    HcSizeClassStats& c = stats.classes[i];
+    c.hits += c.allocs > c.misses ? c.allocs - c.misses : 0;
+  }
+}
+
+size_t ThreadCache::flush() {
+  size_t bytes = 0;
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    FreeList& free_list = free_list_[i];
+    if (free_list.empty()) {
+      continue;
+    }
+
+    // 直接归还给 span，不经过 transfer cache，这样空闲的 span 可以回到 page cache
+    void* start = nullptr;
+    void* end = nullptr;
+    size_t n = free_list.size();
+    free_list.pop_range(start, end, n);
+    size_t size = AlignMap::class_to_size(i);
+    CentralCache::GetInstance()->release_list_to_spans(start, size);
+    bytes += n * size;
+
+    // 重新开始慢启动
+    free_list.max_size() = 1;
   }
-  return tls_thread_cache.get();
+  size_.store(0, std::memory_order_relaxed);
+  return bytes;
 }
 
 void* ThreadCache::allocate(size_t size) {
-  size = AlignMap::align_upwards(size);
   size_t index = AlignMap::hash_bucket_index(size);
+  size = AlignMap::class_to_size(index);
+  counters_[index].allocs_.add();
+
+  // 采样只在这里多一次减法和比较，到了采样间隔才进入慢路径
+  if (bytes_until_sample_ < size) {
+    HeapProfiler* profiler = HeapProfiler::GetInstance();
+    bytes_until_sample_ = profiler->next_sample_interval();
+    if (profiler->sample_rate() != 0) {
+      void* ptr = profiler->allocate_sampled(size);
+      if (ptr != nullptr) {
+        return ptr;
+      }
+    }
+  } else {
+    bytes_until_sample_ -= size;
+  }
+
   if (free_list_[index].empty()) {
     return fetch_from_central_cache(index, size);
   }
+  size_.store(size_.load(std::memory_order_relaxed) - size,
+              std::memory_order_relaxed);
   return free_list_[index].pop_front();
 }
 
@@ -37,37 +320,214 @@ void ThreadCache::deallocate(void* ptr, size_t size) {
 
   // 释放的内存插入到 thread cache 对应桶的自由链表中
   size_t index = AlignMap::hash_bucket_index(size);
+  counters_[index].frees_.add();
   free_list_[index].push_front(ptr);
+  size_t cached = size_.load(std::memory_order_relaxed) + size;
 
   // 如果自由链表中的对象数量超过一定阈值，将多余的对象归还给 central cache
   // 当自由链表长度大于一次批量申请的内存时，就从自由链表中还一段list给 central
   // cache
   FreeList& free_list = free_list_[index];
   if (free_list.size() > free_list.max_size()) {
+    cached -= release_overflow(index, size);
+  }
+  size_.store(cached, std::memory_order_relaxed);
+
+  // 整个 thread cache 超出了字节上限
+  if (cached > max_size_.load(std::memory_order_relaxed)) {
+    scavenge();
+  }
+}
+
+void ThreadCache::allocate_batch(size_t size, void** out, size_t n) {
+  size_t index = AlignMap::hash_bucket_index(size);
+  size = AlignMap::class_to_size(index);
+
+  // 这一批会越过采样点时逐个申请，保证每个字节被采样的概率不变
+  if (bytes_until_sample_ < n * size) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = allocate(size);
+    }
+    return;
+  }
+  bytes_until_sample_ -= n * size;
+  counters_[index].allocs_.add(n);
+
+  FreeList& free_list = free_list_[index];
+  size_t cached = (std::min)(n, free_list.size());
+  for (size_t i = 0; i < cached; ++i) {
+    out[i] = free_list.pop_front();
+  }
+  size_.store(size_.load(std::memory_order_relaxed) - cached * size,
+              std::memory_order_relaxed);
+
+  // 剩下的按整批获取，一次取到尽量多的对象；一批中多出来的对象留在自由链表
+  SizeClassTuner* tuner = SizeClassTuner::GetInstance();
+  size_t i = cached;
+  try {
+    while (i < n) {
+      tuner->record_refill(index);
+      counters_[index].misses_.add();
+      void* start = nullptr;
+      void* end = nullptr;
+      size_t actual_num = CentralCache::GetInstance()->fetch_range_objs(
+          start, end, size, tuner->batch_size(index));
+      for (; actual_num > 0 && i < n; --actual_num, ++i) {
+        out[i] = start;
+        start = get_next_obj(start);
+      }
+      if (actual_num > 0) {
+        free_list.push_range(start, end, actual_num);
+        size_.store(size_.load(std::memory_order_relaxed) + actual_num * size,
+                    std::memory_order_relaxed);
+      }
+    }
+  } catch (...) {
+    for (size_t j = 0; j < i; ++j) {
+      free_list.push_front(out[j]);
+    }
+    size_.store(size_.load(std::memory_order_relaxed) + i * size,
+                std::memory_order_relaxed);
+    throw;
+  }
+
+  // 一批中多出来的对象和逐个释放一样受自由链表容量和字节上限的限制
+  size_t cached_bytes = size_.load(std::memory_order_relaxed);
+  if (free_list.size() > free_list.max_size()) {
+    cached_bytes -= release_excess(index, size);
+    size_.store(cached_bytes, std::memory_order_relaxed);
+  }
+  if (cached_bytes > max_size_.load(std::memory_order_relaxed)) {
+    scavenge();
+  }
+}
+
+void ThreadCache::deallocate_batch(void* const* ptrs, const size_t* sizes,
+                                   size_t n) {
+  // 每段对象按 size class 分组，每组串成一段，交错排列的对象也只
+  // push_range 和检查溢出一次；group_of 中存放组号 + 1，0 表示这一段还没有这个组
+  const size_t kChunk = 64;
+  struct ClassGroup {
+    size_t index;
+    void* start;
+    void* end;
+    size_t count;
+  };
+  ClassGroup groups[kChunk];
+  uint8_t group_of[N_FREE_LIST] = {};
+
+  size_t cached = size_.load(std::memory_order_relaxed);
+  for (size_t base = 0; base < n; base += kChunk) {
+    size_t chunk_end = (std::min)(n, base + kChunk);
+    size_t n_groups = 0;
+    for (size_t i = base; i < chunk_end; ++i) {
+      size_t index = AlignMap::hash_bucket_index(sizes[i]);
+      if (group_of[index] == 0) {
+        groups[n_groups] = ClassGroup{index, ptrs[i], ptrs[i], 1};
+        group_of[index] = static_cast<uint8_t>(++n_groups);
+        continue;
+      }
+      ClassGroup& group = groups[group_of[index] - 1];
+      get_next_obj(ptrs[i]) = group.start;
+      group.start = ptrs[i];
+      ++group.count;
+    }
+
+    for (size_t g = 0; g < n_groups; ++g) {
+      ClassGroup& group = groups[g];
+      size_t index = group.index;
+      size_t size = AlignMap::class_to_size(index);
+      group_of[index] = 0;
+
+      FreeList& free_list = free_list_[index];
+      free_list.push_range(group.start, group.end, group.count);
+      counters_[index].frees_.add(group.count);
+      cached += group.count * size;
+
+      if (free_list.size() > free_list.max_size()) {
+        cached -= release_excess(index, size);
+        // 和逐个释放一样，慢启动阶段的容量继续增长
+        if (free_list.max_size() <
+            SizeClassTuner::GetInstance()->batch_size(index)) {
+          free_list.max_size() += 1;
+        }
+      }
+    }
+  }
+  size_.store(cached, std::memory_order_relaxed);
+
+  if (cached > max_size_.load(std::memory_order_relaxed)) {
+    scavenge();
+  }
+}
+
+size_t ThreadCache::release_excess(size_t index, size_t size) {
+  FreeList& free_list = free_list_[index];
+  SizeClassTuner* tuner = SizeClassTuner::GetInstance();
+  tuner->record_overflow(index);
+  counters_[index].overflows_.add();
+  size_t batch = tuner->batch_size(index);
+  size_t excess = free_list.size() - free_list.max_size();
+  size_t released = excess * size;
+  while (excess > 0) {
     void* start = nullptr;
     void* end = nullptr;
-    // 释放一定数量的对象: free_list.size() - free_list.max_size();
-    // size_t num_objects = free_list.size() - free_list.max_size();
-    size_t num_objects = free_list.max_size();
+    size_t num_objects = (std::min)(excess, batch);
     free_list.pop_range(start, end, num_objects);
+    CentralCache::GetInstance()->release_range_objs(start, end, num_objects,
+                                                    size);
+    excess -= num_objects;
+  }
+  return released;
+}
 
-    // 将 start 到 end 之间的 size 大小的 num_objects 个对象归还给 central cache
-    // 自由链表中的节点间不一定是连续的，所以需要一个个的释放
-    // 无需传递 end ，因为end的next指针是nullptr
-    // 需传递对齐后的size，告知central cache去哪个桶中找
-    CentralCache::GetInstance()->release_list_to_spans(start, size);
+size_t ThreadCache::release_overflow(size_t index, size_t size) {
+  FreeList& free_list = free_list_[index];
+  SizeClassTuner* tuner = SizeClassTuner::GetInstance();
+  tuner->record_overflow(index);
+  counters_[index].overflows_.add();
+  size_t batch = tuner->batch_size(index);
+
+  // 最多归还一整批，作为一批放进 transfer cache
+  void* start = nullptr;
+  void* end = nullptr;
+  size_t num_objects = (std::min)(free_list.max_size(), batch);
+  free_list.pop_range(start, end, num_objects);
+
+  // 将 start 到 end 之间的 size 大小的 num_objects 个对象归还给 central cache
+  // 需传递对齐后的size，告知central cache去哪个桶中找
+  CentralCache::GetInstance()->release_range_objs(start, end, num_objects,
+                                                  size);
+
+  // 慢启动阶段继续增长；已经超过一批的容量在多次溢出后收缩一批，
+  // 避免一次突发让这个线程一直保留很长的自由链表
+  if (free_list.max_size() < batch) {
+    free_list.max_size() += 1;
+  } else if (free_list.max_size() > batch &&
+             ++free_list.overages() > MAX_FREE_LIST_OVERAGES) {
+    free_list.max_size() = (std::max)(free_list.max_size() - batch, batch);
+    free_list.overages() = 0;
   }
+  return num_objects * size;
 }
 
 void* ThreadCache::fetch_from_central_cache(size_t index, size_t size) {
-  // 压缩到 [2, 512] 个对象
-  size_t num_objects = AlignMap::calculate_num_objects(size);
+  FreeList& free_list = free_list_[index];
+  SizeClassTuner* tuner = SizeClassTuner::GetInstance();
+  tuner->record_refill(index);
+  counters_[index].misses_.add();
+  size_t batch = tuner->batch_size(index);
 
   // 慢开始
-  num_objects = (std::min)(free_list_[index].max_size(), num_objects);
-  if (free_list_[index].max_size() == num_objects) {
+  size_t num_objects = (std::min)(free_list.max_size(), batch);
+  if (free_list.max_size() < batch) {
     // 如果使用 max_size_ ，说明 max_size_ 比较小，可以加速增长
-    free_list_[index].max_size() += 1;
+    free_list.max_size() += 1;
+  } else {
+    // 已经能容纳一整批还是取空了，说明这个 size class 用得很多，每次扩大一批容量
+    size_t max_size =
+        (std::min)(free_list.max_size() + batch, MAX_FREE_LIST_LENGTH);
+    free_list.max_size() = (std::max)(max_size - max_size % batch, batch);
   }
 
   // 从中心缓存获取一定数量的对象
@@ -83,7 +543,9 @@ void* ThreadCache::fetch_from_central_cache(size_t index, size_t size) {
     return start;
   } else {
     // 如果申请到的对象不止一个，将多余的对象加入到自由链表中
-    free_list_[index].push_range(get_next_obj(start), end, actual_num - 1);
+    free_list.push_range(get_next_obj(start), end, actual_num - 1);
+    size_.store(size_.load(std::memory_order_relaxed) + (actual_num - 1) * size,
+                std::memory_order_relaxed);
     return start;
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,33 @@
+#include "transfer_cache.h"
+
+bool TransferCache::insert_range(void* start, void* end, size_t n,
+                                 size_t max_objects) {
+  std::lock_guard<SpinLock> lock(lock_);
+  if (used_ >= MAX_TRANSFER_BATCHES ||
+      (used_ > 0 && cached_objects_ + n > max_objects)) {
+    return false;
+  }
+  batches_[used_].start_ = start;
+  batches_[used_].end_ = end;
+  batches_[used_].n_ = n;
+  ++used_;
+  cached_objects_ += n;
+  return true;
+}
+
+size_t TransferCache::remove_range(void*& start, void*& end) {
+  std::lock_guard<SpinLock> lock(lock_);
+  if (used_ == 0) {
+    return 0;
+  }
+  --used_;
+  start = batches_[used_].start_;
+  end = batches_[used_].end_;
+  cached_objects_ -= batches_[used_].n_;
+  return batches_[used_].n_;
+}
+
+size_t TransferCache::cached_objects() {
+  std::lock_guard<SpinLock> lock(lock_);
+  return cached_objects_;
+}
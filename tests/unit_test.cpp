@@ -306,12 +306,1033 @@ void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds) {
   printf("total time: %zu ms\n", malloc_costtime.load() + free_costtime.load());
 }
 
+#if !defined(_WIN32)
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+
+// 当前进程的常驻内存（字节）
+size_t current_rss() {
+  size_t pages = 0, resident = 0;
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp == nullptr) {
+    return 0;
+  }
+  if (fscanf(fp, "%zu %zu", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(fp);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// 大量线程同时存活时，对比 thread cache 和 per-CPU 缓存的吞吐和常驻内存
+// 同一时刻最多只有 CPU 核数个线程在工作（模拟线程数远多于核数的服务），
+// 每个线程反复申请释放一批对象，然后保持存活直到所有线程都完成，此时统计 RSS
+void RunManyThreads(size_t nworks, size_t ntimes, size_t rounds,
+                    bool per_cpu) {
+  if (per_cpu && !hc_set_per_cpu_cache(true)) {
+    printf("per-CPU cache unavailable (rseq not registered)\n");
+    return;
+  }
+
+  size_t rss_before = current_rss();
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t running = 0;
+  size_t max_running = (std::max)(1u, std::thread::hardware_concurrency());
+  size_t finished = 0;
+  bool release = false;
+  size_t rss_peak = 0;
+
+  std::vector<std::thread> vthread(nworks);
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread[k] = std::thread([&]() {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return running < max_running; });
+        ++running;
+      }
+
+      std::vector<void*> v;
+      v.reserve(ntimes);
+      for (size_t j = 0; j < rounds; ++j) {
+        for (size_t i = 0; i < ntimes; i++) {
+          v.push_back(hc_malloc((16 + i) % 8192 + 1));
+        }
+        for (size_t i = 0; i < ntimes; i++) {
+          hc_free(v[i]);
+        }
+        v.clear();
+      }
+
+      // 所有线程都完成前保持存活，这样 thread cache 不会被回收
+      std::unique_lock<std::mutex> lock(mtx);
+      --running;
+      cv.notify_all();
+      if (++finished == nworks) {
+        rss_peak = current_rss();
+        release = true;
+        cv.notify_all();
+      } else {
+        cv.wait(lock, [&]() { return release; });
+      }
+    });
+  }
+  for (auto& t : vthread) {
+    t.join();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  size_t total_ops = nworks * rounds * ntimes * 2;
+  double ms =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+          .count() /
+      1000.0;
+  printf("%-12s %zu threads: %.0f ms, %.2f Mops/s, RSS +%.2f MB\n",
+         per_cpu ? "per-CPU" : "thread cache", nworks, ms,
+         total_ops / ms / 1000.0,
+         (rss_peak - rss_before) / (1024.0 * 1024.0));
+}
+
+void BenchmarkPerCpuCache(size_t nworks, size_t ntimes, size_t rounds) {
+  // 每种模式在单独的子进程中运行，避免互相影响常驻内存的统计
+  for (bool per_cpu : {false, true}) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      RunManyThreads(nworks, ntimes, rounds, per_cpu);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+}
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+// 打开 dTLB load miss 计数器，不支持时返回 -1
+int open_dtlb_miss_counter() {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#else
+int open_dtlb_miss_counter() { return -1; }
+#endif
+
+// 在大量小对象组成的随机链表上做指针追逐，对比普通页和大页下的 dTLB miss
+void RunPointerChase(size_t nodes, size_t hops, bool hugepage) {
+  if (hugepage && !hc_set_hugepage_mode(true)) {
+    printf("hugepage mode unavailable\n");
+    return;
+  }
+
+  struct Node {
+    Node* next_;
+    char payload_[56];
+  };
+
+  std::vector<Node*> v(nodes);
+  for (size_t i = 0; i < nodes; ++i) {
+    v[i] = static_cast<Node*>(hc_malloc(sizeof(Node)));
+  }
+  std::mt19937 gen(12345);
+  std::shuffle(v.begin(), v.end(), gen);
+  for (size_t i = 0; i < nodes; ++i) {
+    v[i]->next_ = v[(i + 1) % nodes];
+  }
+
+  int fd = open_dtlb_miss_counter();
+#if defined(__linux__)
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  auto begin = std::chrono::high_resolution_clock::now();
+  Node* p = v[0];
+  for (size_t i = 0; i < hops; ++i) {
+    p = p->next_;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  long long misses = -1;
+#if defined(__linux__)
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = -1;
+    }
+    close(fd);
+  }
+#endif
+
+  size_t reserved = 0;
+  hc_get_hugepage_stats(&reserved, nullptr);
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+                  .count() /
+              static_cast<double>(hops);
+  printf("%-10s %.2f ns/hop, dTLB misses: ", hugepage ? "hugepage" : "4KB page",
+         ns);
+  if (misses >= 0) {
+    printf("%lld", misses);
+  } else {
+    printf("n/a");
+  }
+  printf(", hugepage-backed %.2f MB (%p)\n", reserved / (1024.0 * 1024.0),
+         static_cast<void*>(p));
+
+  for (Node* node : v) {
+    hc_free(node);
+  }
+}
+
+void BenchmarkHugePage(size_t nodes, size_t hops) {
+  for (bool hugepage : {false, true}) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      RunPointerChase(nodes, hops, hugepage);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+}
+
+// 不同的 thread cache 全局预算下的吞吐和缓存占用
+// 每个线程反复申请释放一批对象，结束前统计所有 thread cache 缓存的字节数
+void RunThreadCacheBudget(size_t nworks, size_t ntimes, size_t rounds,
+                          size_t budget) {
+  hc_set_thread_cache_budget(budget);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t finished = 0;
+  ThreadCacheStats stats;
+
+  std::vector<std::thread> vthread(nworks);
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread[k] = std::thread([&]() {
+      std::vector<void*> v;
+      v.reserve(ntimes);
+      for (size_t j = 0; j < rounds; ++j) {
+        for (size_t i = 0; i < ntimes; i++) {
+          v.push_back(hc_malloc((16 + i) % 8192 + 1));
+        }
+        for (size_t i = 0; i < ntimes; i++) {
+          hc_free(v[i]);
+        }
+        v.clear();
+      }
+
+      // 所有线程都完成前保持存活，这样 thread cache 还在
+      std::unique_lock<std::mutex> lock(mtx);
+      if (++finished == nworks) {
+        stats = hc_get_thread_cache_stats();
+        cv.notify_all();
+      } else {
+        cv.wait(lock, [&]() { return finished == nworks; });
+      }
+    });
+  }
+  for (auto& t : vthread) {
+    t.join();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  size_t total_ops = nworks * rounds * ntimes * 2;
+  double ms =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+          .count() /
+      1000.0;
+  printf(
+      "budget %6.1f MB: %.2f Mops/s, cached %.2f MB in %zu caches "
+      "(max %.2f MB), unclaimed %.2f MB\n",
+      budget / (1024.0 * 1024.0), total_ops / ms / 1000.0,
+      stats.cached_bytes / (1024.0 * 1024.0), stats.thread_count,
+      stats.max_cached_bytes / (1024.0 * 1024.0),
+      stats.unclaimed_bytes / (1024.0 * 1024.0));
+}
+
+void BenchmarkThreadCacheBudget(size_t nworks, size_t ntimes, size_t rounds) {
+  for (size_t budget_mb : {4, 32, 256}) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      RunThreadCacheBudget(nworks, ntimes, rounds, budget_mb * 1024 * 1024);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+}
+
+// 跨线程释放：每轮先由一批线程申请，再由另一批线程释放别的线程申请的对象
+// simulated_nodes 不为 0 时开启模拟的 NUMA 节点，对象会被转交回所属节点
+void RunCrossThreadFree(size_t nworks, size_t ntimes, size_t rounds,
+                        size_t simulated_nodes) {
+  if (simulated_nodes != 0) {
+    hc_set_numa_aware(true, simulated_nodes);
+  }
+
+  std::vector<std::vector<void*>> v(nworks);
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (size_t j = 0; j < rounds; ++j) {
+    std::vector<std::thread> vthread(nworks);
+    for (size_t k = 0; k < nworks; ++k) {
+      vthread[k] = std::thread([&, k]() {
+        v[k].reserve(ntimes);
+        for (size_t i = 0; i < ntimes; i++) {
+          v[k].push_back(hc_malloc((16 + i) % 8192 + 1));
+        }
+      });
+    }
+    for (auto& t : vthread) {
+      t.join();
+    }
+    for (size_t k = 0; k < nworks; ++k) {
+      vthread[k] = std::thread([&, k]() {
+        std::vector<void*>& objs = v[(k + 1) % nworks];
+        for (void* ptr : objs) {
+          hc_free(ptr);
+        }
+        objs.clear();
+      });
+    }
+    for (auto& t : vthread) {
+      t.join();
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  size_t total_ops = nworks * rounds * ntimes * 2;
+  double ms =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+          .count() /
+      1000.0;
+  size_t trimmed = hc_trim();
+  printf("%zu node(s) %zu threads: %.0f ms, %.2f Mops/s, trimmed %.2f MB\n",
+         hc_numa_node_count(), nworks, ms, total_ops / ms / 1000.0,
+         trimmed / (1024.0 * 1024.0));
+}
+
+// 生产者/消费者：一个线程只申请，另一个线程只释放，对象从消费者的 thread cache
+// 溢出到 transfer cache，再被生产者 refill 取走；统计 transfer cache 的命中次数
+// 和 central cache 的加锁次数，命中越多，需要加桶锁遍历 span 的次数越少
+void BenchmarkTransferCache(size_t ntimes, size_t chunk) {
+  const size_t kMaxQueued = 4;
+  for (size_t size : {16, 256, 4096}) {
+    std::mutex queue_lock;
+    std::vector<std::vector<void*>> queue;
+    std::atomic<bool> done{false};
+
+    HcStats before;
+    hc_get_stats(&before);
+    auto begin = std::chrono::high_resolution_clock::now();
+    std::thread producer([&]() {
+      for (size_t i = 0; i < ntimes; i += chunk) {
+        std::vector<void*> objs(chunk);
+        for (void*& ptr : objs) {
+          ptr = hc_malloc(size);
+        }
+        // 队列有界，生产者不会远远跑在消费者前面
+        while (true) {
+          {
+            std::lock_guard<std::mutex> lock(queue_lock);
+            if (queue.size() < kMaxQueued) {
+              queue.push_back(std::move(objs));
+              break;
+            }
+          }
+          std::this_thread::yield();
+        }
+      }
+      done = true;
+    });
+    std::thread consumer([&]() {
+      std::vector<std::vector<void*>> taken;
+      while (true) {
+        bool finished = done;
+        {
+          std::lock_guard<std::mutex> lock(queue_lock);
+          taken.swap(queue);
+        }
+        for (auto& objs : taken) {
+          for (void* ptr : objs) {
+            hc_free(ptr);
+          }
+        }
+        if (taken.empty() && finished) {
+          break;
+        }
+        if (taken.empty()) {
+          std::this_thread::yield();
+        }
+        taken.clear();
+      }
+    });
+    producer.join();
+    consumer.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    HcStats after;
+    hc_get_stats(&after);
+
+    size_t hits = after.transfer_hits - before.transfer_hits;
+    size_t misses = after.transfer_misses - before.transfer_misses;
+    size_t locks = after.central_locks.acquires - before.central_locks.acquires;
+    double ms =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+            .count() /
+        1000.0;
+    printf("size %5zu x %zu: %.0f ms, transfer cache %zu hits / %zu misses, "
+           "%zu central locks (%.2f per 1000 objects)\n",
+           size, ntimes, ms, hits, misses, locks, locks * 1000.0 / ntimes);
+  }
+}
+
+void BenchmarkNuma(size_t nworks, size_t ntimes, size_t rounds) {
+  for (size_t simulated_nodes : {0, 4}) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      RunCrossThreadFree(nworks, ntimes, rounds, simulated_nodes);
+      fflush(stdout);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+}
+#endif
+
+// 释放路径的延迟：分别用 hc_free 和 hc_free_sized 释放
+// 先申请一个较大的存活对象集合，每次按随机顺序释放其中 batch 个再申请回来，
+// 每批对象都能留在 thread cache 中，测到的是前端的释放路径，申请的耗时不计入
+// evict_bytes 不为 0 时每批之前先写一遍这么大的缓冲区（不计时），把页表、
+// span 和对象都挤出 cache，模拟很久没碰过的对象被释放
+void BenchmarkSizedFree(size_t batch, size_t rounds, size_t evict_bytes) {
+  printf("sized free check: %s, %s\n", HC_CHECK_SIZED_FREE ? "on" : "off",
+         evict_bytes != 0 ? "cold caches" : "warm caches");
+  std::vector<char> evict(evict_bytes);
+  std::mt19937 gen(88172645);
+  for (size_t size : {16, 64, 200, 1024, 5000, 40000}) {
+    // 存活集合最多 128MB，大对象一批的总字节数不超过 thread cache 的初始上限
+    size_t live = (std::min)(static_cast<size_t>(1 << 20),
+                             128 * 1024 * 1024 / size);
+    size_t n = (std::min)(batch, MIN_THREAD_CACHE_SIZE / size);
+    std::vector<void*> v(live);
+    for (size_t i = 0; i < live; ++i) {
+      v[i] = hc_malloc(size);
+    }
+
+    std::vector<size_t> picks(n);
+    uint64_t seed = 88172645463325252ULL;
+    double total_ns[2] = {0, 0};
+    for (size_t j = 0; j < rounds; ++j) {
+      for (int sized = 0; sized < 2; ++sized) {
+        // 同一批里不重复选同一个对象：每批从不同的起点等间隔取
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        size_t stride = live / n;
+        for (size_t i = 0; i < n; ++i) {
+          picks[i] = (seed % stride + i * stride) % live;
+        }
+        std::shuffle(picks.begin(), picks.end(), gen);
+        if (!evict.empty()) {
+          memset(evict.data(), static_cast<int>(j + sized), evict.size());
+        }
+        auto begin = std::chrono::high_resolution_clock::now();
+        if (sized) {
+          for (size_t i = 0; i < n; ++i) {
+            hc_free_sized(v[picks[i]], size);
+          }
+        } else {
+          for (size_t i = 0; i < n; ++i) {
+            hc_free(v[picks[i]]);
+          }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        total_ns[sized] +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+                .count();
+        for (size_t i = 0; i < n; ++i) {
+          v[picks[i]] = hc_malloc(size);
+        }
+      }
+    }
+    for (void* ptr : v) {
+      hc_free(ptr);
+    }
+
+    double ns[2] = {total_ns[0] / (n * rounds), total_ns[1] / (n * rounds)};
+    printf("size %6zu (%7zu live): hc_free %6.1f ns, hc_free_sized %6.1f ns "
+           "(%.2fx)\n",
+           size, live, ns[0], ns[1], ns[0] / ns[1]);
+  }
+}
+
+// 对齐申请：检查各种对齐和大小返回的指针都对齐、可用空间足够、能用 hc_free 释放，
+// 统计为了对齐多占用的空间，再比较 64 字节对齐的申请和普通申请的耗时
+void BenchmarkAlignedAlloc(size_t ntimes) {
+  size_t errors = 0;
+  for (size_t alignment = 16; alignment <= 2 * 1024 * 1024; alignment <<= 1) {
+    size_t requested = 0;
+    size_t usable = 0;
+    std::vector<void*> v;
+    for (size_t size = 1; size <= 512 * 1024; size = size * 3 / 2 + 1) {
+      void* ptr = hc_aligned_alloc(alignment, size);
+      if (reinterpret_cast<uintptr_t>(ptr) % alignment != 0 ||
+          hc_malloc_usable_size(ptr) < size) {
+        ++errors;
+      }
+      memset(ptr, 0xab, size);
+      requested += size;
+      usable += hc_malloc_usable_size(ptr);
+      v.push_back(ptr);
+    }
+    for (void* ptr : v) {
+      hc_free(ptr);
+    }
+    printf("alignment %8zu: %.2f%% extra\n", alignment,
+           100.0 * (usable - requested) / requested);
+  }
+  printf("errors: %zu\n", errors);
+
+  for (size_t size : {64, 200, 1000}) {
+    std::vector<void*> v(ntimes);
+    double ns[2] = {0, 0};
+    for (int aligned = 0; aligned < 2; ++aligned) {
+      auto begin = std::chrono::high_resolution_clock::now();
+      for (size_t j = 0; j < 100; ++j) {
+        for (size_t i = 0; i < ntimes; ++i) {
+          v[i] = aligned ? hc_aligned_alloc(64, size) : hc_malloc(size);
+        }
+        for (size_t i = 0; i < ntimes; ++i) {
+          hc_free(v[i]);
+        }
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      ns[aligned] =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+              .count() /
+          (100.0 * ntimes);
+    }
+    printf("size %4zu: hc_malloc %5.1f ns, hc_aligned_alloc(64) %5.1f ns\n",
+           size, ns[0], ns[1]);
+  }
+}
+
+// realloc：按固定步长不断增大一个缓冲区，检查内容保持不变，统计原地调整的比例，
+// 和每次 hc_malloc + memcpy + hc_free 的耗时对比
+void BenchmarkRealloc(size_t max_size, size_t step) {
+  size_t errors = 0;
+  for (int use_realloc = 0; use_realloc < 2; ++use_realloc) {
+    size_t in_place = 0;
+    size_t resizes = 0;
+    auto begin = std::chrono::high_resolution_clock::now();
+    char* buf = nullptr;
+    size_t old_size = 0;
+    for (size_t size = step; size <= max_size; size += step) {
+      char* new_buf = nullptr;
+      if (use_realloc) {
+        new_buf = static_cast<char*>(hc_realloc(buf, size));
+      } else {
+        new_buf = static_cast<char*>(hc_malloc(size));
+        if (buf != nullptr) {
+          memcpy(new_buf, buf, old_size);
+          hc_free(buf);
+        }
+      }
+      in_place += new_buf == buf;
+      ++resizes;
+      // 只写新增的部分，前面的内容应该原样保留
+      memset(new_buf + old_size, static_cast<int>(size / step), size - old_size);
+      if (new_buf[0] != 1 || new_buf[old_size / 2] !=
+                                 static_cast<char>(old_size / 2 / step + 1)) {
+        ++errors;
+      }
+      buf = new_buf;
+      old_size = size;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // 缩小回去同样保留内容
+    for (size_t size = old_size; size >= step; size /= 2) {
+      buf = static_cast<char*>(hc_realloc(buf, size));
+      if (buf[size - 1] != static_cast<char>((size - 1) / step + 1)) {
+        ++errors;
+      }
+    }
+    hc_free(buf);
+    printf("%s: %zu resizes up to %zu bytes, %zu in place, %lld ms\n",
+           use_realloc ? "hc_realloc" : "malloc+memcpy", resizes, max_size,
+           in_place,
+           static_cast<long long>(
+               std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                     begin)
+                   .count()));
+  }
+
+  // 同一个 size class 内调整大小返回原来的指针
+  void* ptr = hc_malloc(100);
+  if (hc_realloc(ptr, AlignMap::align_upwards(100)) != ptr) {
+    ++errors;
+  }
+  hc_free(ptr);
+  printf("errors: %zu\n", errors);
+}
+
+// calloc：检查各种来源的页（新映射的、用过的、归还过的）拿到的都是全 0，
+// 再比较 hc_calloc 和 hc_malloc + memset 申请大块清零内存的耗时
+void BenchmarkCalloc(size_t ntimes) {
+  size_t errors = 0;
+  auto check_zero = [&](const char* ptr, size_t size) {
+    for (size_t i = 0; i < size; i += 97) {
+      if (ptr[i] != 0) {
+        ++errors;
+        return;
+      }
+    }
+    if (ptr[size - 1] != 0) {
+      ++errors;
+    }
+  };
+  for (size_t size : {100, 5000, 300 * 1024, 512 * 1024, 4 * 1024 * 1024}) {
+    // 用过的内存释放后再申请
+    char* ptr = static_cast<char*>(hc_malloc(size));
+    memset(ptr, 0xff, size);
+    hc_free(ptr);
+    ptr = static_cast<char*>(hc_calloc(size / 4, 4));
+    check_zero(ptr, size);
+    memset(ptr, 0xff, size);
+    hc_free(ptr);
+    // 归还给操作系统之后再申请
+    hc_trim();
+    ptr = static_cast<char*>(hc_calloc(1, size));
+    check_zero(ptr, size);
+    hc_free(ptr);
+  }
+  printf("errors: %zu\n", errors);
+
+  for (size_t size : {1024 * 1024, 8 * 1024 * 1024}) {
+    std::vector<void*> v(ntimes);
+    double ms[2] = {0, 0};
+    for (int calloc = 0; calloc < 2; ++calloc) {
+      auto begin = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < ntimes; ++i) {
+        if (calloc) {
+          v[i] = hc_calloc(1, size);
+        } else {
+          v[i] = hc_malloc(size);
+          memset(v[i], 0, size);
+        }
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      ms[calloc] =
+          std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+              .count() /
+          1000.0;
+      for (void* ptr : v) {
+        hc_free(ptr);
+      }
+    }
+    printf("%zu x %zu bytes: hc_malloc+memset %.1f ms, hc_calloc %.1f ms\n",
+           ntimes, size, ms[0], ms[1]);
+  }
+}
+
+// 批量接口：每轮申请 batch 个同样大小的对象再全部释放，
+// 比较逐个 hc_malloc/hc_free 和 hc_malloc_batch/hc_free_batch 的吞吐
+void BenchmarkBatch(size_t batch, size_t rounds) {
+  std::vector<void*> v(batch);
+  size_t errors = 0;
+  for (size_t size : {16, 64, 256, 1024, 8192}) {
+    double ns[2] = {0, 0};
+    for (int batched = 0; batched < 2; ++batched) {
+      auto begin = std::chrono::high_resolution_clock::now();
+      for (size_t j = 0; j < rounds; ++j) {
+        if (batched) {
+          hc_malloc_batch(size, batch, v.data());
+        } else {
+          for (size_t i = 0; i < batch; ++i) {
+            v[i] = hc_malloc(size);
+          }
+        }
+        // 写每个对象的首尾，检查拿到的对象互不重叠
+        for (size_t i = 0; i < batch; ++i) {
+          static_cast<char*>(v[i])[0] = static_cast<char>(i);
+          static_cast<char*>(v[i])[size - 1] = static_cast<char>(i);
+        }
+        for (size_t i = 0; i < batch; ++i) {
+          errors += static_cast<char*>(v[i])[0] != static_cast<char>(i);
+        }
+        if (batched) {
+          hc_free_batch(v.data(), batch);
+        } else {
+          for (size_t i = 0; i < batch; ++i) {
+            hc_free(v[i]);
+          }
+        }
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      ns[batched] =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+              .count() /
+          static_cast<double>(rounds * batch);
+    }
+    printf("size %5zu: hc_malloc/hc_free %6.1f ns, batch %6.1f ns (%.2fx)\n",
+           size, ns[0], ns[1], ns[0] / ns[1]);
+  }
+
+  // 两个 size class 交错排列（A,B,A,B...），批量释放时也要按 size class 分组
+  double free_ns[2] = {0, 0};
+  for (int batched = 0; batched < 2; ++batched) {
+    for (size_t j = 0; j < rounds; ++j) {
+      for (size_t i = 0; i < batch; ++i) {
+        v[i] = hc_malloc(i % 2 == 0 ? 16 : 64);
+      }
+      auto begin = std::chrono::high_resolution_clock::now();
+      if (batched) {
+        hc_free_batch(v.data(), batch);
+      } else {
+        for (size_t i = 0; i < batch; ++i) {
+          hc_free(v[i]);
+        }
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      free_ns[batched] +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+              .count();
+    }
+  }
+  printf("interleaved 16/64: hc_free %6.1f ns, hc_free_batch %6.1f ns "
+         "(%.2fx)\n",
+         free_ns[0] / (rounds * batch), free_ns[1] / (rounds * batch),
+         free_ns[0] / free_ns[1]);
+
+  // 不同大小混在一起释放，包括大内存和 nullptr
+  std::vector<void*> mixed;
+  for (size_t i = 0; i < 1000; ++i) {
+    mixed.push_back(hc_malloc(i % 7 == 0 ? 300 * 1024 : 8 + i % 500));
+  }
+  mixed.push_back(nullptr);
+  hc_free_batch(mixed.data(), mixed.size());
+  printf("errors: %zu\n", errors);
+}
+
+// central cache 的 span 选择：先让很多 span 都分配满，再在每个 span 上释放一个对象
+// 并清空 thread cache，此时每次从 central cache 取对象都要找一个还有空闲对象的 span
+// 之后只保留一小部分对象，每轮随机释放一半再申请回来，看 central cache 还占着多少 span
+void BenchmarkOccupancy(size_t size, size_t live, size_t rounds) {
+  size_t index = AlignMap::hash_bucket_index(size);
+  size_t capacity = AlignMap::span_capacity(index);
+  std::vector<void*> v(live);
+  for (size_t i = 0; i < live; ++i) {
+    v[i] = hc_malloc(size);
+  }
+
+  // 每个 span 上空出一个对象，再申请回来
+  std::vector<size_t> holes;
+  for (size_t i = 0; i < live; i += capacity) {
+    hc_free(v[i]);
+    holes.push_back(i);
+  }
+  hc_thread_cache_flush();
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (size_t i : holes) {
+    v[i] = hc_malloc(size);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  double fetch_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+          .count() /
+      static_cast<double>(holes.size());
+
+  // 只保留 1/8 的对象，然后每轮随机释放一半、清空 thread cache 再申请回来
+  uint64_t seed = 88172645463325252ULL;
+  auto next = [&seed]() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  };
+  size_t kept = 0;
+  for (size_t i = 0; i < live; ++i) {
+    if (next() % 8 != 0) {
+      hc_free(v[i]);
+    } else {
+      v[kept++] = v[i];
+    }
+  }
+  v.resize(kept);
+  hc_thread_cache_flush();
+  HcStats before;
+  hc_get_stats(&before);
+
+  for (size_t j = 0; j < rounds; ++j) {
+    std::vector<size_t> picks;
+    for (size_t i = 0; i < kept; ++i) {
+      if (next() % 2 == 0) {
+        hc_free(v[i]);
+        picks.push_back(i);
+      }
+    }
+    hc_thread_cache_flush();
+    for (size_t i : picks) {
+      v[i] = hc_malloc(size);
+    }
+  }
+  hc_thread_cache_flush();
+  HcStats stats;
+  hc_get_stats(&stats);
+  printf("size %zu, %zu live, %zu spans: fetch after holes %.1f ns/object\n",
+         size, live, live / capacity, fetch_ns);
+  printf("%zu kept: %zu spans, after %zu rounds %zu spans (at least %zu)\n",
+         kept, before.classes[index].spans, rounds, stats.classes[index].spans,
+         (kept + capacity - 1) / capacity);
+
+  for (void* ptr : v) {
+    hc_free(ptr);
+  }
+}
+
+// central cache 的补充和归还：申请大量小对象（大多来自新切分的 span），
+// 再全部释放并清空 thread cache，分别统计两个阶段每个对象的耗时
+// 对比 HC_SPAN_BITMAP 开关前后的结果
+void BenchmarkRefill(size_t total_bytes, size_t rounds) {
+  printf("span bitmap: %s\n", HC_SPAN_BITMAP ? "on" : "off");
+  for (size_t size : {8, 16, 64, 256, 1024}) {
+    size_t n = total_bytes / size;
+    std::vector<void*> v(n);
+    double ns[2] = {0, 0};
+    size_t locks = 0;
+    size_t releases = 0;
+    for (size_t j = 0; j < rounds; ++j) {
+      auto begin = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < n; ++i) {
+        v[i] = hc_malloc(size);
+      }
+      auto middle = std::chrono::high_resolution_clock::now();
+      // 释放阶段 central cache 的加锁次数和归还给 page cache 的 span 数
+      HcStats before;
+      hc_get_stats(&before);
+      auto free_begin = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < n; ++i) {
+        hc_free(v[i]);
+      }
+      hc_thread_cache_flush();
+      auto end = std::chrono::high_resolution_clock::now();
+      HcStats after;
+      hc_get_stats(&after);
+      locks += after.central_locks.acquires - before.central_locks.acquires;
+      releases += after.central_span_releases - before.central_span_releases;
+      ns[0] += std::chrono::duration_cast<std::chrono::nanoseconds>(middle -
+                                                                    begin)
+                   .count();
+      ns[1] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   end - free_begin)
+                   .count();
+    }
+    printf("size %5zu x %7zu: malloc %5.1f ns, free %5.1f ns, "
+           "%zu central locks for %zu span releases\n",
+           size, n, ns[0] / (n * rounds), ns[1] / (n * rounds),
+           locks / rounds, releases / rounds);
+  }
+}
+
+// 桶锁的竞争：threads 个线程反复加同一把锁，临界区内修改 4 个 cache line，
+// 临界区外做一点计算，比较各种锁实现的吞吐、需要等待的比例和平均等待时间
+template <class Lock>
+void BenchmarkLockPolicy(const char* name, size_t threads, size_t total_ops) {
+  BasicBucketMutex<Lock> lock;
+  alignas(64) static size_t shared[32];
+  memset(shared, 0, sizeof(shared));
+  size_t per_thread = total_ops / threads;
+
+  std::vector<std::thread> workers;
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&lock, per_thread]() {
+      volatile size_t local = 0;
+      for (size_t i = 0; i < per_thread; ++i) {
+        {
+          std::lock_guard<BasicBucketMutex<Lock>> guard(lock);
+          for (size_t k = 0; k < 32; k += 8) {
+            ++shared[k];
+          }
+        }
+        for (size_t k = 0; k < 32; ++k) {
+          local = local + k;
+        }
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  double us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+          .count();
+  size_t ops = per_thread * threads;
+  size_t contended = lock.contended();
+  printf("%-5s %2zu threads: %7.2f Mops/s, contended %5.1f%%, "
+         "avg wait %7.0f ns%s\n",
+         name, threads, ops / us, 100.0 * contended / lock.acquires(),
+         contended ? static_cast<double>(lock.wait_ns()) / contended : 0.0,
+         shared[0] == ops && shared[24] == ops ? "" : " (WRONG COUNT)");
+}
+
+void BenchmarkLockPolicies(size_t max_threads, size_t total_ops) {
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    BenchmarkLockPolicy<std::mutex>("mutex", threads, total_ops);
+    BenchmarkLockPolicy<SpinParkMutex>("spin", threads, total_ops);
+    BenchmarkLockPolicy<McsLock>("mcs", threads, total_ops);
+  }
+}
+
+// Span 元数据和页表中的 size class：每个小对象所在页记录的 size class
+// 要和 span 一致，大内存没有记录；再用 sized 模式比较释放的耗时
+void CheckSpanSizeClass() {
+  printf("sizeof(Span) = %zu\n", sizeof(Span));
+  size_t checked = 0;
+  for (size_t size = 1; size <= MAX_BYTES; size += size < 1024 ? 7 : 1021) {
+    void* ptr = hc_malloc(size);
+    Span* span = PageCache::get_span_by_address(ptr);
+    size_t index;
+    if (span->sample_bucket_ == nullptr) {
+      if (!PageCache::get_size_class(ptr, index) ||
+          index != span->size_class_ ||
+          AlignMap::class_to_size(index) != hc_malloc_usable_size(ptr)) {
+        printf("size %zu: size class mismatch\n", size);
+        abort();
+      }
+      ++checked;
+    }
+    hc_free(ptr);
+  }
+
+  void* large = hc_malloc(MAX_BYTES + 1);
+  size_t index;
+  if (PageCache::get_size_class(large, index) ||
+      PageCache::get_span_by_address(large)->obj_size() !=
+          hc_malloc_usable_size(large)) {
+    printf("large object has a size class\n");
+    abort();
+  }
+  hc_free(large);
+  printf("%zu sizes checked\n", checked);
+}
+
 int main2() {
   TestObjectPool();
   return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+#if !defined(_WIN32)
+  if (argc > 1 && strcmp(argv[1], "percpu") == 0) {
+    size_t nworks = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1024;
+    BenchmarkPerCpuCache(nworks, 2000, 5);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "hugepage") == 0) {
+    BenchmarkHugePage(4 * 1024 * 1024, 20 * 1000 * 1000);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "budget") == 0) {
+    size_t nworks = argc > 2 ? strtoul(argv[2], nullptr, 10) : 16;
+    BenchmarkThreadCacheBudget(nworks, 2000, 50);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+    // 跑一轮并发申请释放后输出统计
+    BenchmarkConcurrentMalloc(10000, 4, 2);
+    static char buf[64 * 1024];
+    hc_format_stats(buf, sizeof(buf));
+    fputs(buf, stdout);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "profile") == 0) {
+    // 保留一部分对象，输出 heap profile，可以用 pprof --text 查看
+    const char* path = argc > 2 ? argv[2] : "memory_pool.heap";
+    std::vector<void*> live;
+    for (size_t i = 0; i < 100000; ++i) {
+      void* ptr = hc_malloc((16 + i) % 8192 + 1);
+      if (i % 4 == 0) {
+        live.push_back(ptr);
+      } else {
+        hc_free(ptr);
+      }
+    }
+    bool ok = hc_dump_heap_profile(path);
+    printf("heap profile %s: %s\n", ok ? "written to" : "failed", path);
+    for (void* ptr : live) {
+      hc_free(ptr);
+    }
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "sized") == 0) {
+    BenchmarkSizedFree(256, 2000, 0);
+    BenchmarkSizedFree(256, 20, 256 * 1024 * 1024);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "aligned") == 0) {
+    BenchmarkAlignedAlloc(10000);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "realloc") == 0) {
+    BenchmarkRealloc(16 * 1024 * 1024, 64 * 1024);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "calloc") == 0) {
+    BenchmarkCalloc(64);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    BenchmarkBatch(256, 20000);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "occupancy") == 0) {
+    BenchmarkOccupancy(256, 1 << 18, 16);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "refill") == 0) {
+    BenchmarkRefill(32 * 1024 * 1024, 5);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "locks") == 0) {
+    size_t max_threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+    BenchmarkLockPolicies(max_threads, 1000000);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "span") == 0) {
+    CheckSpanSizeClass();
+    BenchmarkSizedFree(256, 200, 0);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "transfer") == 0) {
+    BenchmarkTransferCache(4000000, 64);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "numa") == 0) {
+    BenchmarkNuma(8, 20000, 10);
+    return 0;
+  }
+#endif
+
   size_t system_page_size = 0;
 #if defined(_WIN32)
   SYSTEM_INFO si;
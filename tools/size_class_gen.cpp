@@ -0,0 +1,329 @@
+// size class 生成工具：根据申请大小的分布生成 size class 表，
+// 在桶数的限制下最小化内部碎片（对象大小取整到 size class 浪费的字节）
+// 加上 span 尾部浪费（span 切成对象后剩下的不足一个对象的字节）
+//
+// 用法：
+//   size_class_gen [-n 桶数] [--prior 比例] [--heap-profile] [-o 输出] 输入
+//
+// 输入默认是直方图，每行 "大小 次数"，# 开头的行是注释；
+// 加上 --heap-profile 时输入是 hc_dump_heap_profile 输出的 heap profile，
+// 每个调用栈按累计申请的平均大小计入
+//
+// 输出的头文件在编译内存池时指定：
+//   cmake -DHC_SIZE_CLASS_TABLE=/path/to/table.h ...
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "common.h"
+
+// 候选的 size class：8，1024 以内 16 的倍数，1024 以上 128 的倍数
+// 满足查表的粒度要求，大于 8 字节的都按 16 字节对齐
+static std::vector<size_t> candidate_sizes() {
+  std::vector<size_t> sizes;
+  sizes.push_back(8);
+  for (size_t size = 16; size <= 1024; size += 16) {
+    sizes.push_back(size);
+  }
+  for (size_t size = 1024 + 128; size <= MAX_BYTES; size += 128) {
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+// 一个 size class 每个对象分摊的 span 尾部浪费
+static double tail_per_object(size_t size) {
+  size_t span_bytes = SizeClassRule::num_pages(size) << kPageShift;
+  return static_cast<double>(span_bytes % size) / (span_bytes / size);
+}
+
+// 申请大小的分布，按候选 size class 划分的区间汇总：
+// count_[j] 和 bytes_[j] 是大小落在 (candidates[j - 1], candidates[j]] 中的
+// 申请次数和申请的字节数
+struct Histogram {
+  std::vector<double> count_;
+  std::vector<double> bytes_;
+  double total_count_ = 0;
+  double total_bytes_ = 0;
+
+  explicit Histogram(const std::vector<size_t>& candidates)
+      : count_(candidates.size(), 0), bytes_(candidates.size(), 0) {}
+
+  void add(const std::vector<size_t>& candidates, size_t size, double count) {
+    if (size == 0) {
+      size = 1;
+    }
+    if (size > MAX_BYTES || count <= 0) {
+      return;  // 大内存不经过 size class
+    }
+    size_t lo = 0;
+    size_t hi = candidates.size() - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (candidates[mid] < size) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    count_[lo] += count;
+    bytes_[lo] += count * size;
+    total_count_ += count;
+    total_bytes_ += count * size;
+  }
+
+  // 先验：把 fraction 倍的申请次数按对数均匀分布摊到所有区间上，
+  // 让输入中没有出现的大小也有合适的 size class
+  void add_prior(const std::vector<size_t>& candidates, double fraction) {
+    double mass = total_count_ * fraction;
+    double total_log = std::log(static_cast<double>(MAX_BYTES));
+    size_t prev = 1;
+    for (size_t j = 0; j < candidates.size(); ++j) {
+      double share =
+          std::log(static_cast<double>(candidates[j]) / prev) / total_log;
+      count_[j] += mass * share;
+      bytes_[j] += mass * share * (prev + candidates[j]) / 2.0;
+      prev = candidates[j];
+    }
+  }
+};
+
+// 读取 "大小 次数" 形式的直方图
+static bool read_histogram(FILE* in, const std::vector<size_t>& candidates,
+                           Histogram& hist) {
+  char line[4096];
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    if (line[0] == '#') {
+      continue;
+    }
+    unsigned long long size = 0;
+    double count = 0;
+    if (sscanf(line, "%llu %lf", &size, &count) == 2) {
+      hist.add(candidates, size, count);
+    }
+  }
+  return hist.total_count_ > 0;
+}
+
+// 读取 heap profile：每行 "存活次数: 存活字节 [累计次数: 累计字节] @ 调用栈"
+static bool read_heap_profile(FILE* in, const std::vector<size_t>& candidates,
+                              Histogram& hist) {
+  char line[4096];
+  bool header = true;
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    if (header) {
+      // 第一行是总计
+      header = false;
+      continue;
+    }
+    if (strncmp(line, "MAPPED_LIBRARIES", 16) == 0) {
+      break;
+    }
+    unsigned long long live_count = 0;
+    unsigned long long live_bytes = 0;
+    unsigned long long alloc_count = 0;
+    unsigned long long alloc_bytes = 0;
+    if (sscanf(line, " %llu: %llu [ %llu: %llu]", &live_count, &live_bytes,
+               &alloc_count, &alloc_bytes) == 4 &&
+        alloc_count > 0) {
+      size_t size = (alloc_bytes + alloc_count / 2) / alloc_count;
+      hist.add(candidates, size, static_cast<double>(alloc_count));
+    }
+  }
+  return hist.total_count_ > 0;
+}
+
+// 一组 size class 按输入分布加权的浪费
+struct Waste {
+  double internal_ = 0;  // 内部碎片的字节数
+  double tail_ = 0;      // span 尾部浪费的字节数
+};
+
+static Waste evaluate(const std::vector<size_t>& candidates,
+                      const Histogram& hist,
+                      const std::vector<size_t>& classes) {
+  Waste waste;
+  size_t c = 0;
+  for (size_t j = 0; j < candidates.size(); ++j) {
+    while (classes[c] < candidates[j]) {
+      ++c;
+    }
+    waste.internal_ += hist.count_[j] * classes[c] - hist.bytes_[j];
+    waste.tail_ += hist.count_[j] * tail_per_object(classes[c]);
+  }
+  return waste;
+}
+
+// 动态规划：f[k][j] 是用 k 个 size class、最大的一个是 candidates[j] 时，
+// 覆盖 [1, candidates[j]] 的最小浪费。最大的 size class 固定为 MAX_BYTES
+static std::vector<size_t> optimize(const std::vector<size_t>& candidates,
+                                    const Histogram& hist, size_t n_classes) {
+  size_t m = candidates.size();
+  n_classes = (std::min)(n_classes, m);
+
+  std::vector<double> prefix_count(m + 1, 0);
+  std::vector<double> prefix_bytes(m + 1, 0);
+  std::vector<double> tail(m);
+  for (size_t j = 0; j < m; ++j) {
+    prefix_count[j + 1] = prefix_count[j] + hist.count_[j];
+    prefix_bytes[j + 1] = prefix_bytes[j] + hist.bytes_[j];
+    tail[j] = tail_per_object(candidates[j]);
+  }
+  // candidates[j] 这个 size class 覆盖区间 i + 1 .. j 的浪费
+  auto cost = [&](size_t i_end, size_t j) {
+    double count = prefix_count[j + 1] - prefix_count[i_end];
+    double bytes = prefix_bytes[j + 1] - prefix_bytes[i_end];
+    return count * (candidates[j] + tail[j]) - bytes;
+  };
+
+  const double kInf = 1e300;
+  std::vector<double> prev(m, kInf);
+  std::vector<double> cur(m, kInf);
+  std::vector<std::vector<uint16_t>> choice(n_classes,
+                                            std::vector<uint16_t>(m, 0));
+  for (size_t j = 0; j < m; ++j) {
+    prev[j] = cost(0, j);
+  }
+  for (size_t k = 1; k < n_classes; ++k) {
+    for (size_t j = k; j < m; ++j) {
+      double best = kInf;
+      size_t best_i = k - 1;
+      for (size_t i = k - 1; i < j; ++i) {
+        double value = prev[i] + cost(i + 1, j);
+        if (value < best) {
+          best = value;
+          best_i = i;
+        }
+      }
+      cur[j] = best;
+      choice[k][j] = static_cast<uint16_t>(best_i);
+    }
+    for (size_t j = 0; j < k; ++j) {
+      cur[j] = kInf;
+    }
+    std::swap(prev, cur);
+  }
+
+  std::vector<size_t> classes(n_classes);
+  size_t j = m - 1;
+  for (size_t k = n_classes; k-- > 0;) {
+    classes[k] = candidates[j];
+    if (k > 0) {
+      j = choice[k][j];
+    }
+  }
+  return classes;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-n classes] [--prior fraction] [--heap-profile] "
+          "[-o output.h] input\n"
+          "  -n              size class 的个数上限（默认 %zu，最多 255）\n"
+          "  --prior         按对数均匀分布补充的申请次数比例（默认 0.05）\n"
+          "  --heap-profile  输入是 hc_dump_heap_profile 输出的 heap profile\n"
+          "  -o              输出的头文件（默认标准输出）\n",
+          name, N_FREE_LIST);
+}
+
+int main(int argc, char* argv[]) {
+  size_t n_classes = N_FREE_LIST;
+  double prior = 0.05;
+  bool heap_profile = false;
+  const char* output = nullptr;
+  const char* input = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      n_classes = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--prior") == 0 && i + 1 < argc) {
+      prior = strtod(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--heap-profile") == 0) {
+      heap_profile = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] != '-' && input == nullptr) {
+      input = argv[i];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (input == nullptr || n_classes < 1 || n_classes > 255) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE* in = fopen(input, "r");
+  if (in == nullptr) {
+    fprintf(stderr, "cannot open %s: %s\n", input, strerror(errno));
+    return 1;
+  }
+  std::vector<size_t> candidates = candidate_sizes();
+  Histogram hist(candidates);
+  bool ok = heap_profile ? read_heap_profile(in, candidates, hist)
+                         : read_histogram(in, candidates, hist);
+  fclose(in);
+  if (!ok) {
+    fprintf(stderr, "%s: no allocations of at most %zu bytes\n", input,
+            MAX_BYTES);
+    return 1;
+  }
+
+  // 先按原始分布评估，再加上先验求解
+  Histogram weighted = hist;
+  weighted.add_prior(candidates, prior);
+  std::vector<size_t> classes = optimize(candidates, weighted, n_classes);
+
+  std::vector<size_t> current(N_FREE_LIST);
+  for (size_t i = 0; i < N_FREE_LIST; ++i) {
+    current[i] = AlignMap::class_to_size(i);
+  }
+  Waste before = evaluate(candidates, hist, current);
+  Waste after = evaluate(candidates, hist, classes);
+  double total = hist.total_bytes_;
+  char summary[512];
+  snprintf(summary, sizeof(summary),
+           "current table (%zu classes): internal %.2f%%, span tail %.2f%%\n"
+           "generated table (%zu classes): internal %.2f%%, span tail %.2f%%\n",
+           current.size(), 100 * before.internal_ / total,
+           100 * before.tail_ / total, classes.size(),
+           100 * after.internal_ / total, 100 * after.tail_ / total);
+  fputs(summary, stderr);
+
+  FILE* out = output != nullptr ? fopen(output, "w") : stdout;
+  if (out == nullptr) {
+    fprintf(stderr, "cannot open %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+  fprintf(out,
+          "// 由 size_class_gen 根据 %s 生成，不要手工修改\n"
+          "// 按输入的分布加权（浪费的字节数 / 申请的字节数）：\n",
+          input);
+  for (const char* p = summary; *p != '\0';) {
+    const char* end = strchr(p, '\n');
+    fprintf(out, "//   %.*s\n", static_cast<int>(end - p), p);
+    p = end + 1;
+  }
+  fprintf(out,
+          "// 使用方法：cmake -DHC_SIZE_CLASS_TABLE=<本文件的绝对路径> ...\n"
+          "#ifndef __HIGH_CONCURRENT_MEMORY_POOL_GENERATED_SIZE_CLASSES_H__\n"
+          "#define __HIGH_CONCURRENT_MEMORY_POOL_GENERATED_SIZE_CLASSES_H__\n"
+          "\n"
+          "// {对象大小, 一次批量移动的对象数, span 的页数}\n"
+          "constexpr SizeClassInfo kSizeClassDefs[] = {\n");
+  for (size_t size : classes) {
+    fprintf(out, "    {%zu, %zu, %zu},\n", size, SizeClassRule::num_objects(size),
+            SizeClassRule::num_pages(size));
+  }
+  fprintf(out,
+          "};\n"
+          "\n"
+          "#endif  // __HIGH_CONCURRENT_MEMORY_POOL_GENERATED_SIZE_CLASSES_H__\n");
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}